@@ -0,0 +1,170 @@
+#include "boruta.c"
+
+#define SZ (64<<20)	/* Size of generated database */
+#define RUNS 3
+
+static char *
+gen(size_t *len)
+{
+	char *buf, *pt, email[32];
+	int t, r;
+
+	buf = malloc(SZ + 4096);
+	if (!buf)
+		return 0;
+
+	pt = buf;
+	for (t=0; pt - buf < SZ; t++) {
+		pt += sprintf(pt, "table%d\n", t);
+		pt += sprintf(pt, "id      name          email                   city       \n");
+		for (r=0; r < 1000 && pt - buf < SZ; r++) {
+			sprintf(email, "user%d@old.camp", r);
+			pt += sprintf(pt, "%-6d  %-12s  %-22s  %-9s  \n",
+				      r, r%3 ? "Gomez" : "Żółć gęślą", email,
+				      r%2 ? "Kraków" : "Warszawa");
+		}
+		pt += sprintf(pt, "\n");
+	}
+
+	*len = pt - buf;
+	return buf;
+}
+
+/* Split BUF to cells only, without storing them in tables. */
+static double
+tokens(char *buf, size_t len)
+{
+	struct timespec a, b;
+	double best, sec;
+	char *str, *end;
+	volatile size_t n;
+	int i;
+
+	end = buf + len;
+	for (best = 0, i=0; i < RUNS; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		for (n = 0, str = buf; str < end; n++)
+			str = skip_spaces((*cell_end)(str, end) +1, end);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+
+		sec = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+		if (!best || sec < best)
+			best = sec;
+	}
+
+	return len / best / 1e9;
+}
+
+/* Format database parsed from BUF to /dev/null.  Tables are given to
+ * WRITE formatter directly, file path would go through temporary file
+ * and skip writes of unchanged database. */
+static double
+writes(char *buf, size_t len)
+{
+	struct timespec a, b;
+	struct table *t;
+	struct out o;
+	double best, sec;
+	char *why;
+	int i;
+
+	if ((why = parse(&db0, buf, len))) {
+		fprintf(stderr, "boruta.b: %s\n", why);
+		exit(1);
+	}
+
+	if ((o.fd = open("/dev/null", O_WRONLY)) == -1 ||
+	    !(o.buf = malloc(WCHUNK))) {
+		fprintf(stderr, "boruta.b: Failed to open output\n");
+		exit(1);
+	}
+
+	for (best = 0, i=0; i < RUNS; i++) {
+		o.fail = 0;
+		o.pos = 0;
+		o.n = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		for (t = db0.tables; t; t = t->next)
+			out_table(&o, t);
+		out_flush(&o);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+
+		if (o.fail) {
+			fprintf(stderr, "boruta.b: Failed to write database\n");
+			exit(1);
+		}
+
+		sec = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+		if (!best || sec < best)
+			best = sec;
+	}
+
+	free(o.buf);
+	close(o.fd);
+
+	while (db0.tables)
+		table_drop(db0.tables);
+
+	return len / best / 1e9;
+}
+
+static double
+bench(char *buf, size_t len)
+{
+	struct timespec a, b;
+	double best, sec;
+	char *why;
+	int i;
+
+	for (best = 0, i=0; i < RUNS; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		why = parse(&db0, buf, len);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+
+		if (why) {
+			fprintf(stderr, "boruta.b: %s\n", why);
+			exit(1);
+		}
+
+		while (db0.tables)
+			table_drop(db0.tables);
+
+		sec = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+		if (!best || sec < best)
+			best = sec;
+	}
+
+	return len / best / 1e9;
+}
+
+int
+main(void)
+{
+	char *buf;
+	size_t len;
+
+	buf = gen(&len);
+	if (!buf)
+		return 1;
+
+	db0_init();
+
+	printf("parse %zu MB\n", len >> 20);
+	printf("scalar\t%.2f GB/s\ttokens %.2f GB/s\n",
+	       bench(buf, len), tokens(buf, len));
+
+	printf("write\t%.2f GB/s\n", writes(buf, len));
+
+	simd_pick();
+	if (cell_end == cell_end_scalar) {
+		printf("simd\tnot supported\n");
+		return 0;
+	}
+
+	printf("simd\t%.2f GB/s\ttokens %.2f GB/s\n",
+	       bench(buf, len), tokens(buf, len));
+
+	free(buf);
+	return 0;
+}
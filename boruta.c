@@ -1,82 +1,526 @@
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _GNU_SOURCE	/* copy_file_range() */
+#endif
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include "boruta.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD
+#include <immintrin.h>
+#endif
+
 #define EMPTY "---"	/* String used for NULL cell values */
 #define CMAX 32	/* Max number of columns */
+#define SMAX 128	/* Max number of values on query stack */
+#define LMAX 24	/* Max level of sorted index skip list */
+#define CHUNK 65536	/* Min size of arena memory chunk */
+#define PMIN (1<<20)	/* Min LOAD bytes per parser thread */
+#define TMAX 64	/* Max number of threads */
+#define EMAX 512	/* Size of error message buffer */
+#define MORSEL 16384	/* Rows filtered by scan thread at once */
+#define BATCH 256	/* Max rows given to batch callback at once */
+#define CMDMAX 4096	/* Max length of query */
+#define SCHUNK (1<<20)	/* Size of STREAM read chunk */
+#define WCHUNK (1<<20)	/* Size of WRITE output buffer */
+#define DEAD 4	/* Compact table with more than 1/DEAD rows deleted */
+#define ALIGN(n) (((n) + sizeof(void*)-1) & ~(sizeof(void*)-1))
+#define CELL(cell) ((struct str *)((cell) - offsetof(struct str, s)))
+#define LIVE(t, r) (!(t)->dn || !(t)->dead[r])
 
 enum { TABLE, COLS, ROWS };	/* Parser state */
+enum { ACOUNT, ASUM, AMIN, AMAX, AAVG };	/* Aggregate function */
+
+struct parser {	/* LOAD state carried between lines */
+	char *str, *end, *why;	/* Parsed range and error */
+	char *base;	/* Memory at POS file offset */
+	off_t pos;
+	struct table *t, *tables;	/* Current and all parsed tables */
+	int state;
+	int blank;	/* Last line was empty */
+	char buf[512];	/* Error message */
+};
+
+struct chunk {	/* Arena memory block */
+	struct chunk *next;
+	size_t sz, off;
+	char buf[];
+};
+
+struct arena {	/* Allocator freed all at once */
+	struct chunk *head;
+	size_t used, waste;	/* Bytes taken and no longer referenced */
+};
+
+struct str {	/* Interned cell value, cells point at S */
+	struct str *next;	/* Dictionary bucket chain */
+	unsigned h;
+	int len, w, refs;	/* Bytes, UTF-8 width and cells count */
+	char s[];
+};
+
+struct dict {	/* Column values interned so equal cells are same pointer */
+	struct str **buckets;
+	unsigned sz, n;
+};
+
+struct key {	/* Index key with rows in ascending order */
+	char *str;
+	unsigned h;
+	int n, cap, *rows;
+	struct key *next;
+};
+
+struct index {	/* Hash index of single column */
+	struct key **buckets;
+	unsigned sz, n;
+};
+
+struct node {	/* Sorted index skip list node */
+	char *str;
+	int row, level;
+	struct node *next[];
+};
 
-struct row {
-	char *cells[CMAX];
-	struct row *next;
+struct tree {	/* Sorted index of single column */
+	struct node *head;
+	int level;
+	unsigned seed;
 };
 
 struct table {
+	struct arena arena;	/* Name, columns and cells memory */
 	char *name, *cols[CMAX];
-	int cn, rn, width[CMAX];
-	struct row *rows, *last;
-	struct table *next;
+	char **cells[CMAX];	/* Column vectors of CAP cells */
+	struct dict dict[CMAX];
+	int cn, rn, cap, width[CMAX];
+	int *wn[CMAX], wsz[CMAX];	/* Count of column values by width */
+	char *dead;	/* Deleted rows flags of CAP size or null */
+	int dn;	/* Deleted rows waiting for compaction */
+	struct index *index[CMAX];	/* Null for not indexed column */
+	struct tree *tree[CMAX];	/* Null for not sorted column */
+	struct table *prev, *next;	/* Insertion order */
+	struct table *hnext;	/* Catalog bucket chain */
+	struct boruta_db *db;	/* Instance table is linked to */
+	int dirty;	/* Modified since last LOAD or WRITE */
+	unsigned gen;	/* Instance GEN of last rows change */
+	off_t off, len;	/* Block in synced file, 0 LEN when unknown */
+	off_t *rowoff;	/* Rows lines offsets in INPLACE map or null */
+};
+
+struct agg {	/* Aggregate of GROUP */
+	int fn;
+	int col;	/* Aggregated column or -1 for COUNT */
 };
 
 struct query {
 	boruta_cb_t cb;
+	boruta_batch_cb_t batch;	/* Used instead of CB when set */
 	void *ctx;
-	char *stack[128], *tname, *eq[CMAX], *neq[CMAX];
+	char *stack[SMAX], *tname, *eq[CMAX], *neq[CMAX];
+	char *lt[CMAX], *le[CMAX], *gt[CMAX], *ge[CMAX];
 	int si, skip, limit;
+	int order;	/* Column index +1 of sorted index walk */
+	int ord[CMAX], on;	/* ORDER columns index +1, negative for desc */
+	struct agg agg[CMAX];
+	int an;	/* Number of AGG */
+	struct table *jt;	/* JOIN table or null */
+	int jcol, jocol;	/* JOIN columns of TABLE and JT */
+	char *jeq[CMAX], *jneq[CMAX];	/* Filters of JT */
 	struct table *table;
+	struct boruta_db *db;
+	struct boruta_cursor *cursor;	/* SELECT opens it when set */
+	struct arena tmp;	/* Memory of single query values */
+	char err[EMAX];	/* Error message returned by word */
+};
+
+struct acc {	/* Aggregate of group rows */
+	double sum;
+	long n;	/* Rows or numbers in SUM */
+	char *cell;	/* MIN or MAX value */
+};
+
+struct group {	/* GROUP output row */
+	struct group *next;	/* Bucket chain */
+	struct group *order;	/* Next in order of first row */
+	unsigned h;
+	struct acc *acc;	/* Of query aggregates */
+	char *key[];	/* Interned cells of group columns */
+};
+
+struct groups {	/* Hash table of groups */
+	struct group **buckets;
+	unsigned sz, n;
+	struct group *first, *last;
+};
+
+struct jscan {	/* Rows iterator over filtered JOIN table */
+	struct table *t;
+	int row;
+	int none;	/* EQ value not in column, nothing matches */
+	char *eq[CMAX], *neq[CMAX];	/* Interned EQ and NEQ values */
+};
+
+struct jhash {	/* JOIN hash table of build side rows */
+	struct table *t;
+	int col;	/* Joined column of T */
+	int *rows, n;	/* Rows of T in table order */
+	int *heads;	/* Of SZ buckets, first ROWS index or -1 */
+	int *next;	/* Next ROWS index in bucket or -1 */
+	unsigned sz;
+};
+
+struct skey {	/* ORDER key of row */
+	double d;	/* First column value if it's number */
+	char *s;	/* First column cell */
+	int num;	/* S is number D */
+	int row;
+};
+
+struct batch {	/* Rows given to callback at once, column major */
+	int n, cn;
+	char **cols;
+	char **vals[CMAX];	/* Of BATCH rows */
+	int *lens[CMAX];
+	void *mem;	/* VALS and LENS */
+};
+
+struct out {	/* Buffered WRITE output */
+	int fd;
+	int fail;	/* Set on first failed write */
+	off_t pos;	/* Bytes already in file */
+	size_t n;	/* Bytes used in BUF */
+	char *buf;	/* Of WCHUNK size */
+};
+
+struct wal {	/* Write ahead log of database file mutations */
+	int fd;	/* Log file or -1 when disabled */
+	char *db;	/* Database file path */
+	int pending;	/* Records not synced yet */
+	int fail;	/* Failed to allocate record */
+	size_t n, cap;	/* Used and allocated size of BUF */
+	char *buf;	/* Record being built */
+};
+
+struct inplace {	/* Synced database file mapped for INPLACE SET */
+	char *path;	/* Null when disabled */
+	int fd;
+	char *map;
+	size_t sz;
+	int pending;	/* Rows changed and not synced yet */
+};
+
+struct boruta_db {	/* Database instance, see boruta_open() */
+	struct table *tables, *tables_last;
+	struct table **catalog;	/* Hash buckets of tables by name */
+	unsigned catalog_sz, catalog_n;
+	unsigned catalog_gen;	/* Changed when tables are added or removed */
+	unsigned gen;	/* Changed when rows of any table change */
+	char *synced;	/* File database was loaded from or written to */
+	struct stat synced_fs;	/* Stats of SYNCED file */
+	int dropped;	/* Some table dropped since SYNCED */
+	struct wal wal;
+	struct inplace inplace;
+	int sync_n;	/* WAL records or INPLACE rows per flush */
+	pthread_rwlock_t lock;	/* Shared by readers, see query_lock() */
+	char err[EMAX];	/* Error of functions not given query */
+};
+
+struct wal_rd {	/* Log record reader */
+	char *str, *end;
+	int bad;	/* Read past record end */
 };
 
-static char *msg(const char *fmt, ...);
+struct word {	/* Query word */
+	char *name;
+	char *(*fn)(struct query *);
+	int write;	/* Modifies database */
+};
+
+struct op {	/* Prepared query step */
+	char *(*fn)(struct query *);	/* Word or null for push */
+	char *str;	/* Pushed value or null for parameter */
+	int param;	/* Index of pushed parameter */
+	struct table *t;	/* TABLE result of catalog GEN */
+	unsigned gen;
+};
+
+struct boruta_stmt {	/* Prepared query */
+	struct boruta_db *db;
+	struct op *ops;
+	int n, pn;	/* Number of OPS and PARAMS */
+	int write;	/* Has word modifying database */
+	char **params;	/* Bound values or nulls */
+	char buf[];	/* Query that OPS values point to */
+};
+
+struct scan {	/* Rows iterator over filtered table */
+	struct query *query;
+	int row;	/* Next row of full table scan */
+	int *post, *pend;	/* Next and end of index key rows */
+	struct node *node;	/* Next node of sorted index scan */
+	int indexed, col;	/* Sorted index column or -1 */
+	int none;	/* EQ value not in column, nothing matches */
+	char *eq[CMAX], *neq[CMAX];	/* Interned EQ and NEQ values */
+	struct morsel *m;	/* Parallel full scan wave or null */
+	int mn, mi, mpos;	/* Morsels in wave, current one and its row */
+};
+
+struct boruta_cursor {	/* SELECT rows read one at a time */
+	struct query q;	/* Filters, SKIP and LIMIT of SELECT */
+	struct scan s;
+	struct table *t;
+	unsigned gen, catalog_gen;	/* Of instance when T was scanned */
+	char *tname;	/* Name T was found by */
+	int cn, coli[CMAX], done;
+	char *cols[CMAX], *row[CMAX];
+	char *buf;	/* Values of ROW */
+	size_t cap;
+	char cmd[CMDMAX];	/* Query that filter values point to */
+};
+
+struct morsel {	/* Rows range filtered by scan thread */
+	struct scan *s;
+	int from, to;
+	int n, rows[MORSEL];	/* Matching rows in order */
+};
+
+static char *msg(char *buf, const char *fmt, ...);
 static int utf8len(char *str);
-static int width(int w, char *cell);
-static char *store(char *str, size_t len);
-static struct table *table_get(char *name);
-static struct table *table_new();
+static int utf8n_scalar(char *str, size_t len);
+static char *cell_end_scalar(char *str, char *end);
+static void simd_pick(void);
+static char *store(struct arena *a, char *str, size_t len);
+static char *storez(struct arena *a, char *str, size_t len);
+static void arena_free(struct arena *a);
+static unsigned hash(char *str);
+static unsigned hashn(char *str, size_t len);
+static int catalog_grow(struct boruta_db *db);
+static struct table *table_find(struct boruta_db *db, char *name, size_t len);
+static struct table *table_get(struct boruta_db *db, char *name);
+static struct table *table_alloc(char *name, size_t len);
+static int table_link(struct boruta_db *db, struct table *t);
+static struct table *table_new(struct boruta_db *db, char *name, size_t len);
+static void table_free(struct table *t);
 static void table_drop(struct table *t);
-static struct row *row_new(struct table *t);
-static void row_del(struct table *t, struct row *r);
+static struct index *index_new(struct table *t, int col);
+static void index_free(struct index *ix);
+static struct key *index_find(struct index *ix, char *str);
+static int index_add(struct index *ix, char *str, int r);
+static void index_rm(struct index *ix, char *str, int r);
+static void index_remap(struct index *ix, int *remap);
+static int number(char *str, double *d);
+static int compare(char *a, char *b);
+static struct tree *tree_new(struct table *t, int col);
+static void tree_free(struct tree *tr);
+static struct node *tree_find(struct tree *tr, char *str, int r, struct node **update);
+static int tree_add(struct tree *tr, char *str, int r);
+static void tree_rm(struct tree *tr, char *str, int r);
+static void tree_remap(struct tree *tr, int *remap);
+static int row_new(struct table *t);
+static int table_compact(struct table *t);
+static int table_gc(struct table *t);
+static char *table_set(struct table *t, char **new, int *rows, int n);
+static char *table_del(struct table *t, int *rows, int n);
+static char *intern(struct table *t, int col, char *str, size_t len);
+static char *interned(struct table *t, int col, char *str);
+static void unref(struct table *t, int col, char *cell);
 static int column_indexof(struct table *t, char *name);
 static char *skip_whitespaces(char *str);
-static char *each_line(char *str);
-static char *each_cell(char *str);
-static char *parse(char *str);
+static char *skip_spaces(char *str, char *end);
+static char *line_end(char *str, char *end);
+static char *perr(struct parser *p, const char *fmt, ...);
+static char *parse_line(struct parser *p, char *str, char *end);
+static void *parse_block(void *arg);
+static char *block_next(char *str, char *end);
+static void parallel(void *(*fn)(void *), void *args, size_t sz, int n);
+static char *parse_link(struct boruta_db *db, struct parser *p, int n);
+static char *parse(struct boruta_db *db, char *str, size_t len);
+static char *stream(struct boruta_db *db, int fd);
+static void out_flush(struct out *o);
+static void out_put(struct out *o, char *str, size_t len);
+static void out_pad(struct out *o, size_t n);
+static void out_table(struct out *o, struct table *t);
+static void synced_set(struct boruta_db *db, char *path, struct stat *fs);
+static int synced_same(struct boruta_db *db, int fd);
+static void out_copy(struct out *o, int fd, off_t off, off_t len);
+static char *write_atomic(struct boruta_db *db, char *path);
+static void wal_put(struct boruta_db *db, char *str, size_t len);
+static void wal_u32(struct boruta_db *db, unsigned v);
+static void wal_str(struct boruta_db *db, char *str);
+static void wal_begin(struct boruta_db *db, int op, char *table);
+static char *wal_end(struct boruta_db *db);
+static char *wal_create(struct table *t);
+static char *wal_insert(struct table *t, int r);
+static char *wal_set(struct table *t, char **new, int *rows, int n);
+static char *wal_del(struct table *t, int *rows, int n);
+static char *wal_drop(struct boruta_db *db, char *table);
+static char *wal_mark(struct boruta_db *db, struct stat *fs);
+static char *wal_base(struct boruta_db *db, char *path);
+static char *wal_truncate(struct boruta_db *db);
+static void wal_close(struct boruta_db *db);
+static unsigned wal_rd_u32(struct wal_rd *rd);
+static char *wal_rd_str(struct wal_rd *rd, struct arena *a);
+static int wal_rd_next(struct wal_rd *rd, struct wal_rd *body);
+static int wal_rd_mark(struct wal_rd *body, struct stat *fs);
+static char *wal_apply(struct query *q, int op, struct wal_rd *rd);
+static char *wal_replay(struct boruta_db *db, char *path);
+static char *inplace_open(struct boruta_db *db, char *path);
+static void inplace_close(struct boruta_db *db);
+static char *inplace_flush(struct boruta_db *db);
+static int inplace_rows(struct table *t);
+static char *inplace_slot(struct table *t, int r, int col, size_t *cap);
+static int inplace_set(struct table *t, char **v, int *rows, int n);
 static void push(struct query *query, char *word);
 static char *pop(struct query *query);
 static char *next(char **cp);
-static int filter(struct query *query, struct row *r);
+static void row_out(struct query *query, int cn, char **cols, char **row);
+static void query_fail(struct query *query, char *why);
+static int batch_init(struct batch *b, int cn, char **cols);
+static void batch_flush(struct query *query, struct batch *b);
+static int column_find(struct query *query, char *name);
+static char *cond(struct query *query, char **dst, char **jdst);
+static int filter(struct scan *s, int r);
+static void scan_init(struct scan *s, struct query *query);
+static void scan_par(struct scan *s);
+static void *scan_morsel(void *arg);
+static int scan_wave(struct scan *s);
+static void scan_free(struct scan *s);
+static int scan_next(struct scan *s);
+static int *matches(struct query *query, int *n);
+static struct word *word(char *str);
+static char *table_op(struct query *query, struct op *op);
+static char *columns(struct query *query, int *coli, int *cn);
+static char *aggregate(struct query *query, int fn);
+static char *agg_name(struct query *query, int i);
+static struct group *group_get(struct query *query, struct groups *g, char **key, int gn);
+static void group_add(struct query *query, struct group *gr, int r);
+static char *group_row(struct query *query, struct batch *b, struct group *gr, int gn);
+static void jscan_init(struct jscan *js, struct query *query);
+static int jscan_next(struct jscan *js);
+static int *jscan_rows(struct query *query, int *n);
+static void skey_set(struct query *query, struct skey *k, int r);
+static int skey_cmp(struct query *query, struct skey *a, struct skey *b);
+static void heap_down(struct query *query, struct skey *k, int n, int i);
+static void skey_sort(struct query *query, struct skey *k, struct skey *tmp, int n);
+static struct skey *order_rows(struct query *query, int *n);
+static int jhash_init(struct jhash *h, struct table *t, int col, int *rows, int n);
+static void jhash_free(struct jhash *h);
+static int join_row(struct query *query, struct batch *b, int *coli, int lr, int rr);
+static char *join_select(struct query *query, int *coli, int cn);
+static void db_init(struct boruta_db *db);
+static void db0_init(void);
+static void query_lock(struct boruta_db *db, int write);
+static struct boruta_db *instance(struct boruta_db *db);
+static char *query_run(struct query *q, char *cmd, size_t sz, char *fmt, va_list ap);
+static char *cursor_select(struct boruta_cursor *c, int *coli, int cn);
+static char *cursor_row(struct boruta_cursor *c, int r);
+static void stmt_run(boruta_stmt *st, struct query *q);
 
 static char *Table(struct query*);
 static char *Info(struct query*);
 static char *Load(struct query*);
+static char *Stream(struct query*);
 static char *Write(struct query*);
 static char *Eq(struct query*);
 static char *Neq(struct query*);
+static char *Lt(struct query*);
+static char *Le(struct query*);
+static char *Gt(struct query*);
+static char *Ge(struct query*);
+static char *Between(struct query*);
+static char *Order(struct query*);
 static char *Skip(struct query*);
 static char *Limit(struct query*);
 static char *Select(struct query*);
+static char *Count(struct query*);
+static char *Sum(struct query*);
+static char *Min(struct query*);
+static char *Max(struct query*);
+static char *Avg(struct query*);
+static char *Group(struct query*);
+static char *Join(struct query*);
 static char *Create(struct query*);
 static char *Insert(struct query*);
 static char *Set(struct query*);
 static char *Del(struct query*);
 static char *Drop(struct query*);
+static char *Index(struct query*);
+static char *Sorted(struct query*);
 static char *Null(struct query*);
 static char *Now(struct query*);
-
-static struct table *tables = 0;
+static char *Wal(struct query*);
+static char *Sync(struct query*);
+static char *Checkpoint(struct query*);
+static char *Inplace(struct query*);
+
+/* Scanners picked by simd_pick() for processor */
+static int (*utf8n)(char *str, size_t len) = utf8n_scalar;
+static char *(*cell_end)(char *str, char *end) = cell_end_scalar;
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+static struct boruta_db db0;	/* Instance of boruta() */
+static pthread_once_t db0_once = PTHREAD_ONCE_INIT;
+
+static struct word words[] = {
+	{"TABLE", Table, 0},
+	{"INFO", Info, 0},
+	{"LOAD", Load, 1},
+	{"STREAM", Stream, 1},
+	{"WRITE", Write, 1},
+	{"EQ", Eq, 0},
+	{"NEQ", Neq, 0},
+	{"LT", Lt, 0},
+	{"LE", Le, 0},
+	{"GT", Gt, 0},
+	{"GE", Ge, 0},
+	{"BETWEEN", Between, 0},
+	{"ORDER", Order, 0},
+	{"SKIP", Skip, 0},
+	{"LIMIT", Limit, 0},
+	{"SELECT", Select, 0},
+	{"COUNT", Count, 0},
+	{"SUM", Sum, 0},
+	{"MIN", Min, 0},
+	{"MAX", Max, 0},
+	{"AVG", Avg, 0},
+	{"GROUP", Group, 0},
+	{"JOIN", Join, 0},
+	{"CREATE", Create, 1},
+	{"INSERT", Insert, 1},
+	{"SET", Set, 1},
+	{"DEL", Del, 1},
+	{"DROP", Drop, 1},
+	{"INDEX", Index, 1},
+	{"SORTED", Sorted, 1},
+	{"NULL", Null, 0},
+	{"NOW", Now, 0},
+	{"WAL", Wal, 1},
+	{"SYNC", Sync, 1},
+	{"CHECKPOINT", Checkpoint, 1},
+	{"INPLACE", Inplace, 1},
+	{0, 0, 0}
+};
 
 static char *
-msg(const char *fmt, ...)
+msg(char *buf, const char *fmt, ...)
 {
-	static char buf[4096];
 	va_list ap;
 
 	va_start(ap, fmt);
-	vsnprintf(buf, sizeof buf, fmt, ap);
+	vsnprintf(buf, EMAX, fmt, ap);
 	va_end(ap);
 
 	return buf;
@@ -85,752 +529,4404 @@ msg(const char *fmt, ...)
 static int
 utf8len(char *str)
 {
-	int i, n;
+	return (*utf8n)(str, strlen(str));
+}
+
+/* Return number of UTF-8 characters in LEN bytes of STR. */
+static int
+utf8n_scalar(char *str, size_t len)
+{
+	size_t i;
+	int n;
 
-	for (i=0, n=0; str[i]; i++)
+	for (i=0, n=0; i < len; i++)
 		if ((str[i] & 0xC0) != 0x80)
 			n++;
 	return n;
 }
 
+/* Return two spaces separator or new line ending cell at STR or END. */
+static char *
+cell_end_scalar(char *str, char *end)
+{
+	for (; str < end; str++)
+		if (*str == '\n' || (str[0] == ' ' && str+1 < end && str[1] == ' '))
+			break;
+
+	return str;
+}
+
+#ifdef SIMD
+/* Bytes that are not UTF-8 continuation bytes, 0x80 to 0xBF, are
+ * greater than -65 when compared as signed. */
 static int
-width(int w, char *cell)
+utf8n_sse2(char *str, size_t len)
 {
-	for (; *cell; cell++)
-		if ((*cell & 0xC0) == 0x80)
-			w++;
-	return w;
+	__m128i lead;
+	size_t i;
+	int n;
+
+	lead = _mm_set1_epi8(-65);
+
+	for (i=0, n=0; i+16 <= len; i+=16)
+		n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(
+			_mm_loadu_si128((__m128i *)(str+i)), lead)));
+
+	return n + utf8n_scalar(str+i, len-i);
 }
 
+/* Compare each byte and the one after it with space and each byte
+ * with new line at once. */
 static char *
-store(char *str, size_t len)
+cell_end_sse2(char *str, char *end)
 {
-	char *pt;
+	__m128i sp, nl, a, b;
+	int m;
+
+	sp = _mm_set1_epi8(' ');
+	nl = _mm_set1_epi8('\n');
+
+	for (; str+17 <= end; str+=16) {
+		a = _mm_loadu_si128((__m128i *)str);
+		b = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(str+1)), sp);
+		b = _mm_and_si128(_mm_cmpeq_epi8(a, sp), b);
+		m = _mm_movemask_epi8(_mm_or_si128(b, _mm_cmpeq_epi8(a, nl)));
+		if (m)
+			return str + __builtin_ctz(m);
+	}
+
+	return cell_end_scalar(str, end);
+}
+
+__attribute__((target("avx2")))
+static int
+utf8n_avx2(char *str, size_t len)
+{
+	__m256i lead;
+	size_t i;
+	int n;
+
+	lead = _mm256_set1_epi8(-65);
+
+	for (i=0, n=0; i+32 <= len; i+=32)
+		n += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(
+			_mm256_loadu_si256((__m256i *)(str+i)), lead)));
+
+	return n + utf8n_sse2(str+i, len-i);
+}
+
+__attribute__((target("avx2")))
+static char *
+cell_end_avx2(char *str, char *end)
+{
+	__m256i sp, nl, a, b;
+	unsigned m;
+
+	sp = _mm256_set1_epi8(' ');
+	nl = _mm256_set1_epi8('\n');
+
+	for (; str+33 <= end; str+=32) {
+		a = _mm256_loadu_si256((__m256i *)str);
+		b = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(str+1)), sp);
+		b = _mm256_and_si256(_mm256_cmpeq_epi8(a, sp), b);
+		m = _mm256_movemask_epi8(_mm256_or_si256(b, _mm256_cmpeq_epi8(a, nl)));
+		if (m)
+			return str + __builtin_ctz(m);
+	}
+
+	return cell_end_sse2(str, end);
+}
+#endif
+
+static void
+simd_pick(void)
+{
+#ifdef SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		utf8n = utf8n_avx2;
+		cell_end = cell_end_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		utf8n = utf8n_sse2;
+		cell_end = cell_end_sse2;
+	}
+#endif
+}
+
+/* Copy LEN bytes of STR to arena or only allocate when STR is null.
+ * For LEN -1 STR is copied with its null terminator. */
+static char *
+store(struct arena *a, char *str, size_t len)
+{
+	struct chunk *c;
+	size_t sz;
 
 	if (str && len == (size_t)-1)
 		len = strlen(str) +1;
 
-	pt = malloc(len);
-	if (!pt)
-		return 0;
+	c = a->head;
+	if (c)
+		c->off = ALIGN(c->off);
+
+	if (!c || c->sz - c->off < len) {
+		/* Aligned offset stays within chunk of aligned size */
+		sz = len > CHUNK ? ALIGN(len) : CHUNK;
+		c = malloc(sizeof *c + sz);
+		if (!c)
+			return 0;
+
+		c->sz = sz;
+		c->off = 0;
+
+		/* Oversized chunk goes behind the current one so free
+		 * space of current is not lost. */
+		if (a->head && sz > CHUNK) {
+			c->next = a->head->next;
+			a->head->next = c;
+		} else {
+			c->next = a->head;
+			a->head = c;
+		}
+	}
 
 	if (str)
-		memcpy(pt, str, len);
+		memcpy(c->buf + c->off, str, len);
+
+	c->off += len;
+	a->used += len;
 
+	return c->buf + c->off - len;
+}
+
+/* Store LEN bytes of STR as null terminated string. */
+static char *
+storez(struct arena *a, char *str, size_t len)
+{
+	char *pt;
+
+	pt = store(a, 0, len +1);
+	if (!pt)
+		return 0;
+
+	memcpy(pt, str, len);
+	pt[len] = 0;
 	return pt;
 }
 
+static void
+arena_free(struct arena *a)
+{
+	struct chunk *c;
+
+	while ((c = a->head)) {
+		a->head = c->next;
+		free(c);
+	}
+
+	a->used = 0;
+	a->waste = 0;
+}
+
+static unsigned
+hash(char *str)
+{
+	return hashn(str, strlen(str));
+}
+
+/* FNV-1a */
+static unsigned
+hashn(char *str, size_t len)
+{
+	unsigned h;
+
+	for (h = 2166136261u; len--; str++)
+		h = (h ^ (unsigned char)*str) * 16777619u;
+
+	return h;
+}
+
+static int
+catalog_grow(struct boruta_db *db)
+{
+	struct table **new, *t;
+	unsigned sz, i;
+
+	sz = db->catalog_sz ? db->catalog_sz * 2 : 64;
+	new = calloc(sz, sizeof *new);
+	if (!new)
+		return -1;
+
+	/* All tables are on the tables list so rehash is done by
+	 * walking it instead of old buckets. */
+	for (t = db->tables; t; t = t->next) {
+		i = hash(t->name) & (sz-1);
+		t->hnext = new[i];
+		new[i] = t;
+	}
+
+	free(db->catalog);
+	db->catalog = new;
+	db->catalog_sz = sz;
+	return 0;
+}
+
 static struct table *
-table_get(char *name)
+table_find(struct boruta_db *db, char *name, size_t len)
 {
 	struct table *t;
 
-	for (t = tables; t; t = t->next)
-		if (!strcmp(t->name, name))
+	if (!db->catalog)
+		return 0;
+
+	for (t = db->catalog[hashn(name, len) & (db->catalog_sz-1)]; t; t = t->hnext)
+		if (!strncmp(t->name, name, len) && !t->name[len])
 			return t;
 
 	return 0;
 }
 
 static struct table *
-table_new()
+table_get(struct boruta_db *db, char *name)
+{
+	return table_find(db, name, strlen(name));
+}
+
+/* Return new table that is not yet in catalog. */
+static struct table *
+table_alloc(char *name, size_t len)
 {
-	struct table *last, *new=0;
+	struct table *new;
 
 	new = malloc(sizeof *new);
 	if (!new)
 		return 0;
 
 	memset(new, 0, sizeof *new);
-
-	if (tables) {
-		for (last = tables; last->next; last = last->next);
-		last->next = new;
-	} else {
-		tables = new;
+	new->name = storez(&new->arena, name, len);
+	if (!new->name) {
+		free(new);
+		return 0;
 	}
+
 	return new;
 }
 
-static void
-table_drop(struct table *t)
+/* Append table to catalog. */
+static int
+table_link(struct boruta_db *db, struct table *t)
 {
-	struct table *parent;
+	unsigned i;
 
-	parent = 0;
+	if (db->catalog_n >= db->catalog_sz && catalog_grow(db))
+		return -1;
 
-	if (t == tables)
-		tables = t->next;
+	t->db = db;
+	t->gen = ++db->gen;
+	t->next = 0;
+	t->prev = db->tables_last;
+	if (db->tables_last)
+		db->tables_last->next = t;
 	else
-		for (parent = tables; parent; parent = parent->next)
-			if (parent->next == t)
-				break;
-
-	if (parent)
-		parent->next = t->next;
+		db->tables = t;
+	db->tables_last = t;
 
-	while (t->rows)
-		row_del(t, t->rows);
+	i = hash(t->name) & (db->catalog_sz-1);
+	t->hnext = db->catalog[i];
+	db->catalog[i] = t;
+	db->catalog_n++;
+	db->catalog_gen++;
 
-	free(t);
+	return 0;
 }
 
-static struct row *
-row_new(struct table *t)
+static struct table *
+table_new(struct boruta_db *db, char *name, size_t len)
 {
-	struct row *new;
+	struct table *new;
 
-	new = malloc(sizeof *new);
+	new = table_alloc(name, len);
 	if (!new)
 		return 0;
 
-	memset(new, 0, sizeof *new);
-
-	if (!t->rows)
-		t->rows = new;
-
-	if (t->last)
-		t->last->next = new;
-
-	t->last = new;
-	t->rn++;
+	if (table_link(db, new)) {
+		table_free(new);
+		return 0;
+	}
 
 	return new;
 }
 
 static void
-row_del(struct table *t, struct row *r)
+table_drop(struct table *t)
 {
-	struct row *parent;
+	struct boruta_db *db;
+	struct table **tp;
 
-	parent = 0;
-
-	if (r == t->rows)
-		t->rows = r->next;
+	db = t->db;
+	if (t->prev)
+		t->prev->next = t->next;
 	else
-		for (parent = t->rows; parent; parent = parent->next)
-			if (parent->next == r)
-				break;
+		db->tables = t->next;
 
-	if (parent)
-		parent->next = r->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	else
+		db->tables_last = t->prev;
 
-	if (r == t->last)
-		t->last = parent;
+	tp = &db->catalog[hash(t->name) & (db->catalog_sz-1)];
+	while (*tp != t)
+		tp = &(*tp)->hnext;
+	*tp = t->hnext;
+	db->catalog_n--;
+	db->catalog_gen++;
 
-	free(r);
-	t->rn--;
+	table_free(t);
 }
 
-static int
-column_indexof(struct table *t, char *name)
+static void
+table_free(struct table *t)
 {
 	int i;
 
-	for (i=0; i < t->cn; i++)
-		if (!strcmp(t->cols[i], name))
-			return i;
-
-	return -1;
-}
+	for (i=0; i < t->cn; i++) {
+		index_free(t->index[i]);
+		tree_free(t->tree[i]);
+		free(t->cells[i]);
+		free(t->dict[i].buckets);
+		free(t->wn[i]);
+	}
 
-static char *
-skip_whitespaces(char *str)
-{
-	while (*str && *str == ' ') str++;
-	return str;
+	free(t->dead);
+	arena_free(&t->arena);
+	free(t->rowoff);
+	free(t);
 }
 
-static char *
-each_line(char *str)
+static struct index *
+index_new(struct table *t, int col)
 {
-	while (*str != 0 && *str != '\n')
-		str++;
+	struct index *ix;
+	int r;
 
-	if (*str == 0)
+	ix = malloc(sizeof *ix);
+	if (!ix)
 		return 0;
 
-	*str = 0;
-	return str +1;
+	memset(ix, 0, sizeof *ix);
+
+	for (r=0; r < t->rn; r++)
+		if (LIVE(t, r) && index_add(ix, t->cells[col][r], r)) {
+			index_free(ix);
+			return 0;
+		}
+
+	return ix;
 }
 
-static char *
-each_cell(char *str)
+static void
+index_free(struct index *ix)
 {
-	while (*str != 0 && *str != '\n' && !(str[0] == ' ' && str[1] == ' '))
-		str++;
+	struct key *k, *knext;
+	unsigned i;
 
-	while (*str == ' ') {
-		*str = 0;
-		str++;
-	}
+	if (!ix)
+		return;
 
-	if (*str == 0 || *str == '\n')
-		return 0;
+	for (i=0; i < ix->sz; i++)
+		for (k = ix->buckets[i]; k; k = knext) {
+			knext = k->next;
+			free(k->rows);
+			free(k);
+		}
 
-	return str;
+	free(ix->buckets);
+	free(ix);
 }
 
-static char *
-parse(char *str)
+static struct key *
+index_find(struct index *ix, char *str)
 {
-	struct table *t;
-	struct row *r;
-	int i, n, state;
-	char *line, *next_line, *cell, *next_cell;
-
-	t = 0;
-	r = 0;
-	r = 0;
+	struct key *k;
+	unsigned h;
 
-	state = TABLE;
-	for (line = str; line; line = next_line) {
-		line = skip_whitespaces(line);
-		next_line = each_line(line);
+	if (!ix->sz)
+		return 0;
 
-		if (*line == 0) {	/* Empty line */
-			state = TABLE;
-			continue;
-		}
+	h = hash(str);
 
-		switch (state) {
-		case ROWS:
-			r = row_new(t);
-			if (!r)
-				return msg("Failed creating row for table %s", t->name);
-			break;
-		}
+	for (k = ix->buckets[h & (ix->sz-1)]; k; k = k->next)
+		if (k->h == h && !strcmp(k->str, str))
+			return k;
 
-		for (i=0, cell = line; cell; i++, cell = next_cell) {
-			cell = skip_whitespaces(cell);
-			next_cell = each_cell(cell);
+	return 0;
+}
 
-			if (i > CMAX)
-				return msg("Cells count (%d) exceeded in table %s", CMAX, t->name);
+static int
+index_add(struct index *ix, char *str, int r)
+{
+	struct key *k, **new;
+	unsigned i, sz;
+	int *rows, lo, hi, mid;
+
+	if (ix->n >= ix->sz) {
+		sz = ix->sz ? ix->sz * 2 : 64;
+		new = calloc(sz, sizeof *new);
+		if (!new)
+			return -1;
+
+		for (i=0; i < ix->sz; i++)
+			while ((k = ix->buckets[i])) {
+				ix->buckets[i] = k->next;
+				k->next = new[k->h & (sz-1)];
+				new[k->h & (sz-1)] = k;
+			}
 
-			switch (state) {
-			case TABLE:
-				t = table_get(cell);
-				if (t)
-					return msg("Table %s already exist", cell);
+		free(ix->buckets);
+		ix->buckets = new;
+		ix->sz = sz;
+	}
 
-				t = table_new();
-				if (!t)
-					return msg("Failed to create new table %s", cell);
+	k = index_find(ix, str);
+	if (!k) {
+		k = malloc(sizeof *k);
+		if (!k)
+			return -1;
+
+		memset(k, 0, sizeof *k);
+		k->str = str;
+		k->h = hash(str);
+		i = k->h & (ix->sz-1);
+		k->next = ix->buckets[i];
+		ix->buckets[i] = k;
+		ix->n++;
+	}
 
-				t->name = cell;
+	if (k->n == k->cap) {
+		rows = realloc(k->rows, (k->cap ? k->cap * 2 : 4) * sizeof *rows);
+		if (!rows)
+			return -1;
 
-				if (next_cell)
-					return msg("Unexpected cell after table %s name", t->name);
+		k->rows = rows;
+		k->cap = k->cap ? k->cap * 2 : 4;
+	}
 
-				state = COLS;
-				break;
-			case COLS:
-				t->cn++;
-				t->cols[i] = cell;
-				t->width[i] = utf8len(cell);
-				if (!next_cell)
-					state = ROWS;
-				break;
-			case ROWS:
-				r->cells[i] = cell;
-				n = utf8len(cell);
-				if (n > t->width[i])
-					t->width[i] = n;
-				break;
-			}
+	/* New rows are appended, only SET puts row in the middle */
+	lo = k->n;
+	if (lo && k->rows[lo-1] > r)
+		for (lo=0, hi = k->n; lo < hi;) {
+			mid = (lo + hi) / 2;
+			if (k->rows[mid] < r)
+				lo = mid +1;
+			else
+				hi = mid;
 		}
-	}
+
+	memmove(k->rows + lo +1, k->rows + lo, (k->n - lo) * sizeof *k->rows);
+	k->rows[lo] = r;
+	k->n++;
 
 	return 0;
 }
 
 static void
-push(struct query *query, char *word)
+index_rm(struct index *ix, char *str, int r)
 {
-	query->stack[query->si++] = word;
+	struct key *k, **kp;
+	int lo, hi, mid;
+
+	k = index_find(ix, str);
+	if (!k)
+		return;
+
+	for (lo=0, hi = k->n; lo < hi;) {
+		mid = (lo + hi) / 2;
+		if (k->rows[mid] < r)
+			lo = mid +1;
+		else
+			hi = mid;
+	}
+
+	if (lo == k->n || k->rows[lo] != r)
+		return;
+
+	memmove(k->rows + lo, k->rows + lo +1, (k->n - lo -1) * sizeof *k->rows);
+
+	if (--k->n)
+		return;
+
+	for (kp = &ix->buckets[k->h & (ix->sz-1)]; *kp != k; kp = &(*kp)->next);
+	*kp = k->next;
+	free(k->rows);
+	free(k);
+	ix->n--;
 }
 
-static char *
-pop(struct query *query)
+/* Renumber indexed rows with REMAP where -1 is removed row. */
+static void
+index_remap(struct index *ix, int *remap)
 {
-	return query->si ? query->stack[--(query->si)] : 0;
+	struct key *k, **kp;
+	unsigned i;
+	int j, n;
+
+	for (i=0; i < ix->sz; i++)
+		for (kp = &ix->buckets[i]; (k = *kp);) {
+			for (j=0, n=0; j < k->n; j++)
+				if (remap[k->rows[j]] != -1)
+					k->rows[n++] = remap[k->rows[j]];
+
+			k->n = n;
+			if (n) {
+				kp = &k->next;
+				continue;
+			}
+
+			*kp = k->next;
+			free(k->rows);
+			free(k);
+			ix->n--;
+		}
 }
 
-static char *
-next(char **cp)
+/* Return index of new row with uninitialized cells or -1. */
+static int
+row_new(struct table *t)
 {
-	char terminate, *word;
+	char **cells, *dead;
+	int i, cap;
 
-	*cp = skip_whitespaces(*cp);
-	if (!**cp)
-		return 0;
+	if (t->rn == t->cap) {
+		cap = t->cap ? t->cap * 2 : 64;
 
-	switch (**cp) {
-	case '"': case '\'':	/* Explicite strings */
-		terminate = **cp;
-		(*cp)++;
-		break;
-	default:
-		terminate = ' ';
-	}
+		for (i=0; i < t->cn; i++) {
+			cells = realloc(t->cells[i], cap * sizeof *cells);
+			if (!cells)
+				return -1;
 
-	word = *cp;
+			t->cells[i] = cells;
+		}
 
-	while (**cp && **cp != '\n' && **cp != terminate)
-		(*cp)++;
+		if (t->dead) {
+			if (!(dead = realloc(t->dead, cap)))
+				return -1;
 
-	/* TODO(irek): So ugly */
-	if (**cp) {
-		**cp = 0;
-		(*cp)++;
-	} else {
-		**cp = 0;
+			memset(dead + t->cap, 0, cap - t->cap);
+			t->dead = dead;
+		}
+
+		t->cap = cap;
 	}
 
-	return word;
+	return t->rn++;
 }
 
+/* Remove deleted rows keeping order of remaining rows. */
 static int
-filter(struct query *query, struct row *r)
+table_compact(struct table *t)
 {
-	int i;
-	char *str;
+	int *remap, i, r, n;
 
-	for (i=0; i < query->table->cn; i++) {
-		str = query->eq[i];
-		if (str && strcmp(str, r->cells[i]))
-			return 1;
+	remap = malloc(t->rn * sizeof *remap + 1);
+	if (!remap)
+		return -1;
 
-		str = query->neq[i];
-		if (str && !strcmp(str, r->cells[i]))
-			return 1;
+	for (r=0, n=0; r < t->rn; r++)
+		remap[r] = t->dead[r] ? -1 : n++;
+
+	for (i=0; i < t->cn; i++) {
+		for (r=0; r < t->rn; r++)
+			if (remap[r] != -1)
+				t->cells[i][remap[r]] = t->cells[i][r];
+
+		if (t->index[i])
+			index_remap(t->index[i], remap);
+
+		if (t->tree[i])
+			tree_remap(t->tree[i], remap);
 	}
 
-	return 0;
-}
+	memset(t->dead, 0, t->rn);
+	t->rn = n;
+	t->dn = 0;
+	free(remap);
 
-static char *
-Table(struct query *query)
-{
-	query->tname = pop(query);
-	query->table = table_get(query->tname);
+	/* Rows lines in INPLACE map are found again for new numbers */
+	free(t->rowoff);
+	t->rowoff = 0;
 	return 0;
 }
 
-static char *
-Info(struct query *query)
+/* Move table strings to new arena if more than half of current one
+ * is wasted by values no longer referenced by any cell. */
+static int
+table_gc(struct table *t)
 {
-	int i;
-	char buf0[32], buf1[32], buf2[32], *cols[4], *row[4];
-	struct table *t;
+	struct arena new = {0};
+	struct key *k;
+	struct node *n;
+	struct str *p, *next, *copy, *head;
+	char **cell;
+	size_t sz;
+	unsigned j;
+	int i, r;
 
-	if (query->tname && !query->table)
-		return msg("No table named %s", query->tname);
+	if (t->arena.used < CHUNK || t->arena.waste < t->arena.used / 2)
+		return 0;
 
-	cols[0] = "index";
-	row[0] = buf0;
+	sz = ALIGN(strlen(t->name) +1);
+	for (i=0; i < t->cn; i++) {
+		sz += ALIGN(strlen(t->cols[i]) +1);
+		for (j=0; j < t->dict[i].sz; j++)
+			for (p = t->dict[i].buckets[j]; p; p = p->next)
+				sz += ALIGN(sizeof *p + p->len +1);
+	}
 
-	if (query->table) {	/* List table columns */
-		if (query->table->cn == 0)
-			return msg("Table %s has no columns", query->tname);
+	/* Take all memory upfront in single chunk so copying can't fail
+	 * half way and leave table broken. */
+	if (!store(&new, 0, sz))
+		return -1;
 
-		cols[1] = "column";
+	new.head->off = 0;
+	new.used = 0;
 
-		for (i=0; i < query->table->cn; i++) {
-			snprintf(buf0, sizeof buf0, "%d", i);
-			row[1] = query->table->cols[i];
-			(*query->cb)(query->ctx, 0, 2, cols, row);
-		}
-	} else {		/* List tables */
-		if (!tables)
-			return "No tables";
+	t->name = store(&new, t->name, -1);
 
-		cols[1] = "columns";
-		cols[2] = "rows";
-		cols[3] = "table";
-		row[1] = buf1;
-		row[2] = buf2;
+	for (i=0; i < t->cn; i++) {
+		t->cols[i] = store(&new, t->cols[i], -1);
 
-		for (i=0, t = tables; t; t = t->next, i++) {
-			snprintf(buf0, sizeof buf0, "%d", i);
-			snprintf(buf1, sizeof buf1, "%d", t->cn);
-			snprintf(buf2, sizeof buf2, "%d", t->rn);
-			row[3] = t->name;
-			(*query->cb)(query->ctx, 0, 4, cols, row);
+		/* Old values keep pointer to their copy in NEXT */
+		for (j=0; j < t->dict[i].sz; j++) {
+			for (head = 0, p = t->dict[i].buckets[j]; p; p = next) {
+				next = p->next;
+				copy = (struct str *)store(&new, (char *)p, sizeof *p + p->len +1);
+				copy->next = head;
+				head = copy;
+				p->next = copy;
+			}
+			t->dict[i].buckets[j] = head;
+		}
+
+		for (r=0; r < t->rn; r++) {
+			cell = &t->cells[i][r];
+			if (*cell)	/* Deleted row */
+				*cell = CELL(*cell)->next->s;
 		}
+
+		/* Index strings are cells of indexed rows */
+		if (t->index[i])
+			for (j=0; j < t->index[i]->sz; j++)
+				for (k = t->index[i]->buckets[j]; k; k = k->next)
+					k->str = t->cells[i][k->rows[0]];
+
+		if (t->tree[i])
+			for (n = t->tree[i]->head->next[0]; n; n = n->next[0])
+				n->str = t->cells[i][n->row];
 	}
 
+	arena_free(&t->arena);
+	t->arena = new;
+
+	/* Cursor filter values no longer point at table cells */
+	t->gen = ++t->db->gen;
 	return 0;
 }
 
+/* Return cell with LEN bytes of STR value shared by all equal cells
+ * of column COL or 0 when out of memory. */
 static char *
-Load(struct query *query)
+intern(struct table *t, int col, char *str, size_t len)
 {
-	char *why, *str;
-	struct stat fs = {0};
-	FILE *fp;
-	size_t sz;
-
-	str = pop(query);
-	if (!str)
-		return "Missing file path";
-
-	if (stat(str, &fs) == -1)
-		return "Failed to read file stats";
+	struct dict *d;
+	struct str *p, **new;
+	unsigned h, i, sz;
+	int w, *wn;
+
+	d = &t->dict[col];
+	h = hashn(str, len);
+
+	if (d->sz)
+		for (p = d->buckets[h & (d->sz-1)]; p; p = p->next)
+			if (p->h == h && p->len == (int)len &&
+			    !memcmp(p->s, str, len)) {
+				p->refs++;
+				return p->s;
+			}
 
-	str = store(str, fs.st_size +1);
-	if (!str)
-		return "Failed to allocate memory in storage";
+	if (d->n >= d->sz) {
+		sz = d->sz ? d->sz * 2 : 16;
+		new = calloc(sz, sizeof *new);
+		if (!new)
+			return 0;
 
-	if (!(fp = fopen(str, "r")))
-		return msg("Failed to open file '%s'", str);
+		for (i=0; i < d->sz; i++)
+			while ((p = d->buckets[i])) {
+				d->buckets[i] = p->next;
+				p->next = new[p->h & (sz-1)];
+				new[p->h & (sz-1)] = p;
+			}
 
-	sz = fread(str, 1, fs.st_size, fp);
-	str[sz++] = 0;
+		free(d->buckets);
+		d->buckets = new;
+		d->sz = sz;
+	}
 
-	if (fclose(fp))
-		return "Failed to close file";
+	/* Width can't be bigger than LEN, make room for it upfront */
+	if ((int)len >= t->wsz[col]) {
+		sz = len < 16 ? 32 : len * 2;
+		wn = realloc(t->wn[col], sz * sizeof *wn);
+		if (!wn)
+			return 0;
 
-	if (sz != (size_t)fs.st_size +1)
-		return "Failed to read entire file";
+		memset(wn + t->wsz[col], 0, (sz - t->wsz[col]) * sizeof *wn);
+		t->wn[col] = wn;
+		t->wsz[col] = sz;
+	}
 
-	why = parse(str);
-	if (why)
-		return why;
+	p = (struct str *)store(&t->arena, 0, sizeof *p + len +1);
+	if (!p)
+		return 0;
 
-	return 0;
+	memcpy(p->s, str, len);
+	p->s[len] = 0;
+	p->h = h;
+	p->len = len;
+	p->w = (*utf8n)(p->s, len);
+	p->refs = 1;
+	p->next = d->buckets[h & (d->sz-1)];
+	d->buckets[h & (d->sz-1)] = p;
+	d->n++;
+
+	w = p->w;
+	t->wn[col][w]++;
+	if (w > t->width[col])
+		t->width[col] = w;
+
+	return p->s;
 }
 
+/* Return cell of column COL equal to STR or 0 if there is none. */
 static char *
-Write(struct query *query)
+interned(struct table *t, int col, char *str)
 {
-	char *str;
-	FILE *fp;
-	struct table *t;
-	struct row *r;
-	int i;
+	struct dict *d;
+	struct str *p;
+	unsigned h;
 
-	if (!tables)
-		return "Nothing to write";
+	d = &t->dict[col];
+	if (!d->sz)
+		return 0;
 
-	fp = stdout;
-	str = pop(query);
+	h = hash(str);
+	for (p = d->buckets[h & (d->sz-1)]; p; p = p->next)
+		if (p->h == h && !strcmp(p->s, str))
+			return p->s;
 
-	if (str && !(fp = fopen(str, "w")))
-		return msg("Failed to open file '%s'", str);
+	return 0;
+}
 
-	for (t = tables; t; t = t->next) {
-		fprintf(fp, "%s\n", t->name);
+/* Release CELL of column COL that is no longer used by row. */
+static void
+unref(struct table *t, int col, char *cell)
+{
+	struct dict *d;
+	struct str *p, **pp;
+	int w, min;
 
-		for (i=0; t->cols[i]; i++)
-			fprintf(fp, "%-*s  ",
-				width(t->width[i], t->cols[i]),
-				t->cols[i]);
-		fprintf(fp, "\n");
+	p = CELL(cell);
+	if (--p->refs)
+		return;
 
-		for (r = t->rows; r; r = r->next) {
-			for (i=0; r->cells[i]; i++)
-				fprintf(fp, "%-*s  ",
-					width(t->width[i], r->cells[i]),
-					r->cells[i]);
-			fprintf(fp,"\n");
-		}
-		fprintf(fp, "\n");
-	}
+	d = &t->dict[col];
+	for (pp = &d->buckets[p->h & (d->sz-1)]; *pp != p; pp = &(*pp)->next);
+	*pp = p->next;
+	d->n--;
 
-	if (fp != stdout && fclose(fp))
-		return "Failed to close file";
+	t->arena.waste += ALIGN(sizeof *p + p->len +1);
 
-	return 0;
+	/* Shrink width to next widest value, but not below column name */
+	if (--t->wn[col][p->w] || p->w < t->width[col])
+		return;
+
+	min = utf8len(t->cols[col]);
+	for (w = p->w; w > min && !t->wn[col][w]; w--);
+	t->width[col] = w > min ? w : min;
 }
 
-static char *
-Eq(struct query *query)
+/* Parse whole STR as decimal number to D, return 0 if it's not one. */
+static int
+number(char *str, double *d)
 {
-	char *column, *value;
-	int i;
-
-	if (!query->table)
-		return "Undefined table";
-
-	while (1) {
-		column = pop(query);
-		value = pop(query);
+	char *end;
+	int neg;
 
-		if (!column)
-			break;	/* End, nothing more on stack */
+	neg = *str == '-';
+	if (*str == '-' || *str == '+')
+		str++;
 
-		if (!value)
-			return msg("Missing value for column %s", column);
+	/* Only decimal numbers, strtod() also takes hex, inf and nan */
+	if (*str < '0' || *str > '9' || str[1] == 'x' || str[1] == 'X')
+		return 0;
 
-		i = column_indexof(query->table, column);
-		if (i == -1)
-			return msg("Column %s don't exist", column);
+	*d = strtod(str, &end);
+	if (*end)
+		return 0;
 
-		query->eq[i] = value;
-	}
+	if (neg)
+		*d = -*d;
 
-	return 0;
+	return 1;
 }
 
-static char *
-Neq(struct query *query)
+/* Numbers are ordered numerically and before any other string that is
+ * ordered lexically.  Mixing both ways of comparing for any pair of
+ * strings would not give a total order. */
+static int
+compare(char *a, char *b)
 {
-	char *column, *value;
-	int i;
+	double x, y;
+	int na, nb;
 
-	if (!query->table)
-		return "Undefined table";
+	na = number(a, &x);
+	nb = number(b, &y);
 
-	while (1) {
-		column = pop(query);
-		value = pop(query);
+	if (na && nb)
+		return (x > y) - (x < y);
 
-		if (!column)
-			break;	/* End, nothing more on stack */
+	if (na != nb)
+		return nb - na;
 
-		if (!value)
-			return msg("Missing value for column %s", column);
+	return strcmp(a, b);
+}
 
-		i = column_indexof(query->table, column);
-		if (i == -1)
-			return msg("Column %s don't exist", column);
+static struct tree *
+tree_new(struct table *t, int col)
+{
+	struct tree *tr;
+	int r;
 
-		query->neq[i] = value;
-	}
+	tr = malloc(sizeof *tr);
+	if (!tr)
+		return 0;
 
-	return 0;
-}
+	tr->head = malloc(sizeof *tr->head + LMAX * sizeof tr->head->next[0]);
+	if (!tr->head) {
+		free(tr);
+		return 0;
+	}
 
-static char *
-Skip(struct query *query)
-{
-	char *str;
+	memset(tr->head, 0, sizeof *tr->head + LMAX * sizeof tr->head->next[0]);
+	tr->head->level = LMAX;
+	tr->level = 1;
+	tr->seed = 2463534242u;
 
-	str = pop(query);
-	query->skip = str ? atoi(str) : 0;
+	for (r=0; r < t->rn; r++)
+		if (LIVE(t, r) && tree_add(tr, t->cells[col][r], r)) {
+			tree_free(tr);
+			return 0;
+		}
 
-	return 0;
+	return tr;
 }
 
-static char *
-Limit(struct query *query)
+static void
+tree_free(struct tree *tr)
 {
-	char *str;
+	struct node *n, *next;
 
-	str = pop(query);
-	query->limit = str ? atoi(str) : 0;
+	if (!tr)
+		return;
 
-	return 0;
+	for (n = tr->head; n; n = next) {
+		next = n->next[0];
+		free(n);
+	}
+
+	free(tr);
 }
 
-static char *
-Select(struct query *query)
+/* Return first node with value and row greater or equal STR and R.
+ * Use R -1 for first and INT_MAX for past last row of value.  When
+ * UPDATE is given it's filled with last nodes before that node on
+ * each level. */
+static struct node *
+tree_find(struct tree *tr, char *str, int r, struct node **update)
 {
-	struct row *r;
-	char *str, *cols[CMAX], *row[CMAX];
-	int i, j, coli[CMAX], cn;
-
-	if (!query->table)
-		return "Undefined table";
-
-	cn = 0;
+	struct node *n;
+	int l, c;
 
-	for (i=CMAX; i>0;) {
-		str = pop(query);
-		if (!str)
-			break;
+	n = tr->head;
 
-		if (!strcmp(str, "*")) {
-			for (j = query->table->cn; j > 0;)
-				coli[--i] = --j;
-			continue;
+	for (l = tr->level; l--;) {
+		while (n->next[l]) {
+			c = compare(n->next[l]->str, str);
+			if (c == 0)
+				c = (n->next[l]->row > r) - (n->next[l]->row < r);
+			if (c >= 0)
+				break;
+			n = n->next[l];
 		}
 
-		j = column_indexof(query->table, str);
-		if (j == -1)
-			return msg("Unknown column %s", str);
-
-		coli[--i] = j;
+		if (update)
+			update[l] = n;
 	}
 
-	cn = CMAX - i;
-	if (cn == 0)
-		return "Nothing to select";
+	return n->next[0];
+}
 
-	for (j=0; j<cn; j++)
-		coli[j] = coli[i++];
+static int
+tree_add(struct tree *tr, char *str, int r)
+{
+	struct node *n, *update[LMAX];
+	int l, level;
 
-	for (i=0; i<cn; i++)
-		cols[i] = query->table->cols[coli[i]];
+	tree_find(tr, str, r, update);
 
-	for (r = query->table->rows; r; r = r->next) {
-		if (filter(query, r))
-			continue;
+	/* Xorshift with 1/4 chance of each next level */
+	for (level = 1; level < LMAX; level++) {
+		tr->seed ^= tr->seed << 13;
+		tr->seed ^= tr->seed >> 17;
+		tr->seed ^= tr->seed << 5;
+		if (tr->seed & 3)
+			break;
+	}
 
-		if (query->skip) {
-			query->skip--;
-			continue;
-		}
+	n = malloc(sizeof *n + level * sizeof n->next[0]);
+	if (!n)
+		return -1;
 
-		for (i=0; i<cn; i++)
-			row[i] = r->cells[coli[i]];
+	n->str = str;
+	n->row = r;
+	n->level = level;
 
-		(*query->cb)(query->ctx, 0, cn, cols, row);
+	for (; tr->level < level; tr->level++)
+		update[tr->level] = tr->head;
 
-		if (query->limit && !(--query->limit))
-			return 0;
+	for (l=0; l < level; l++) {
+		n->next[l] = update[l]->next[l];
+		update[l]->next[l] = n;
 	}
 
 	return 0;
 }
 
-static char *
-Create(struct query *query)
+static void
+tree_rm(struct tree *tr, char *str, int r)
 {
-	char *cell, *cells[CMAX] = {0};
-	int i, j;
+	struct node *n, *update[LMAX];
+	int l;
 
-	if (!query->tname)
-		return "Missing table name";
+	n = tree_find(tr, str, r, update);
+	if (!n || n->row != r)
+		return;
 
-	if (query->table)
-		return "Table already exists";
+	for (l=0; l < n->level; l++)
+		update[l]->next[l] = n->next[l];
 
-	query->table = table_new();
-	if (!query->table)
-		return "Failed to create new table";
+	free(n);
 
-	query->table->name = store(query->tname, -1);
+	while (tr->level > 1 && !tr->head->next[tr->level-1])
+		tr->level--;
+}
 
-	for (i=0; i < CMAX-1 && (cell = pop(query)); i++)
-		cells[i] = store(cell, -1);
+/* Renumber rows with REMAP where -1 is removed row. */
+static void
+tree_remap(struct tree *tr, int *remap)
+{
+	struct node *n, *prev;
+	int l;
+
+	/* Unlink removed nodes from upper levels before freeing them */
+	for (l = tr->level; l--;)
+		for (prev = tr->head; (n = prev->next[l]);) {
+			if (remap[n->row] != -1) {
+				prev = n;
+				continue;
+			}
 
-	/* NOTE(irek): Decrement to preserve columns order. */
-	for (j=0; i--; j++) {
-		cell = cells[i];
-		query->table->cn++;
-		query->table->cols[j] = cell;
-		query->table->width[j] = utf8len(cell);
-	}
+			prev->next[l] = n->next[l];
+			if (l == 0)
+				free(n);
+		}
 
-	return 0;
+	for (n = tr->head->next[0]; n; n = n->next[0])
+		n->row = remap[n->row];
+
+	while (tr->level > 1 && !tr->head->next[tr->level-1])
+		tr->level--;
 }
 
+/* Set values NEW of not null columns in N ROWS of table T. */
 static char *
-Insert(struct query *query)
+table_set(struct table *t, char **new, int *rows, int n)
 {
-	struct row *r;
-	char *column, *value, *cells[CMAX]={0};
-	int i, w;
+	struct boruta_db *db;
+	char *why, **cell, *v[CMAX];
+	int i, j, r, clean;
+	struct str *p;
 
-	if (!query->table)
-		return "Undefined table";
+	if (!n)
+		return 0;
 
-	while (1) {
-		column = pop(query);
-		value = pop(query);
+	db = t->db;
+	why = 0;
+	clean = !t->dirty;
 
-		if (!column)
-			break;	/* End, nothing more on stack */
+	/* New values are interned once and hold single reference until
+	 * all rows are updated. */
+	for (i=0; i < t->cn; i++)
+		if ((v[i] = new[i]) && !(v[i] = intern(t, i, v[i], strlen(v[i])))) {
+			while (i--)
+				if (v[i])
+					unref(t, i, v[i]);
+			return msg(db->err, "Failed to store cell of table %s", t->name);
+		}
 
-		if (!value)
-			return msg("Missing value for column %s", column);
+	for (j=0; j<n; j++)
+		for (r = rows[j], i=0; i < t->cn; i++) {
+			cell = &t->cells[i][r];
+			if (!v[i] || v[i] == *cell)
+				continue;
 
-		i = column_indexof(query->table, column);
-		if (i == -1)
-			return msg("Column %s don't exist", column);
+			if (t->index[i])
+				index_rm(t->index[i], *cell, r);
 
-		cells[i] = value;
-	}
+			if (t->tree[i])
+				tree_rm(t->tree[i], *cell, r);
 
-	r = row_new(query->table);
-	if (!r)
-		return msg("Failed to create row for table %s", query->table->name);
+			unref(t, i, *cell);
+			p = CELL(v[i]);
+			p->refs++;
+			*cell = p->s;
 
-	for (i=0; i < query->table->cn; i++) {
-		r->cells[i] = cells[i] ? store(cells[i], -1) : EMPTY;
-		w = utf8len(r->cells[i]);
-		if (w > query->table->width[i])
-			query->table->width[i] = w;
-	}
+			if ((t->index[i] && index_add(t->index[i], *cell, r)) ||
+			    (t->tree[i] && tree_add(t->tree[i], *cell, r)))
+				why = msg(db->err, "Failed to index column %s", t->cols[i]);
+		}
 
-	return 0;
+	/* Table stays same as synced file if it was changed too */
+	t->dirty = !(clean && !why && inplace_set(t, v, rows, n));
+	t->gen = ++db->gen;
+
+	for (i=0; i < t->cn; i++)
+		if (v[i])
+			unref(t, i, v[i]);
+
+	if (table_gc(t))
+		return "Failed to free table memory";
+
+	return why;
 }
 
+/* Delete N ROWS of table T.  Rows are only marked as deleted and
+ * their cells released, they are removed all at once by compaction
+ * when enough of them gathers, so each DEL doesn't move whole table. */
 static char *
-Set(struct query *query)
+table_del(struct table *t, int *rows, int n)
 {
-	struct table *t;
-	struct row *r;
-	char *column, *value, *new[CMAX]={0};
-	int i;
+	int i, j, r;
 
-	t = query->table;
-	if (!t)
-		return "Undefined table";
+	if (!n)
+		return 0;
 
-	while (1) {
-		column = pop(query);
-		value = pop(query);
+	if (!t->dead && !(t->dead = calloc(t->cap, 1)))
+		return "Failed to allocate memory for deleted rows";
+
+	for (j=0; j<n; j++) {
+		r = rows[j];
+		if (t->dead[r])
+			continue;
+
+		for (i=0; i < t->cn; i++) {
+			if (t->index[i])
+				index_rm(t->index[i], t->cells[i][r], r);
+
+			if (t->tree[i])
+				tree_rm(t->tree[i], t->cells[i][r], r);
+
+			unref(t, i, t->cells[i][r]);
+			t->cells[i][r] = 0;
+		}
+
+		t->dead[r] = 1;
+		t->dn++;
+	}
+
+	t->dirty = 1;
+	t->gen = ++t->db->gen;
+
+	if (t->dn * DEAD > t->rn && table_compact(t))
+		return "Failed to allocate memory for deleted rows";
+
+	return table_gc(t) ? "Failed to free table memory" : 0;
+}
+
+static int
+column_indexof(struct table *t, char *name)
+{
+	int i;
+
+	for (i=0; i < t->cn; i++)
+		if (!strcmp(t->cols[i], name))
+			return i;
+
+	return -1;
+}
+
+static char *
+skip_whitespaces(char *str)
+{
+	while (*str && *str == ' ') str++;
+	return str;
+}
+
+/* Set parser error and return 0. */
+static char *
+perr(struct parser *p, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(p->buf, sizeof p->buf, fmt, ap);
+	va_end(ap);
+
+	p->why = p->buf;
+	return 0;
+}
+
+static char *
+skip_spaces(char *str, char *end)
+{
+	while (str < end && *str == ' ') str++;
+	return str;
+}
+
+/* Return new line character ending line at STR or END.  There is no
+ * need for own vector scanner here as memchr() already is one. */
+static char *
+line_end(char *str, char *end)
+{
+	char *nl;
+
+	nl = memchr(str, '\n', end - str);
+	return nl ? nl : end;
+}
+
+/* Parse line at STR and return beginning of next line or 0 on error.
+ * Parsing doesn't modify or keep STR because cells are copied to tables
+ * memory, so it can point at read only memory. */
+static char *
+parse_line(struct parser *p, char *str, char *end)
+{
+	struct table *t;
+	int i, r, last;
+	char *cell, *next, *line;
+
+	t = p->t;
+	line = str;
+	str = skip_spaces(str, end);
+
+	if (str == end || *str == '\n') {	/* Empty line */
+		p->state = TABLE;
+		p->blank = str < end;
+		return str == end ? end : str +1;
+	}
+
+	p->blank = 0;
+
+	r = -1;
+
+	switch (p->state) {
+	case ROWS:
+		r = row_new(t);
+		if (r == -1)
+			return perr(p, "Failed creating row for table %s", t->name);
+		break;
+	}
+
+	for (i=0, cell = str; ; i++, cell = next) {
+		str = (*cell_end)(cell, end);
+		next = skip_spaces(str, end);
+		last = next == end || *next == '\n';
+
+		if (i >= CMAX)
+			return perr(p, "Cells count (%d) exceeded in table %s", CMAX, t->name);
+
+		switch (p->state) {
+		case TABLE:
+			/* Tables are added to catalog by parse() after
+			 * all blocks are parsed. */
+			t = table_alloc(cell, str - cell);
+			if (!t)
+				return perr(p, "Failed to create new table %.*s", (int)(str - cell), cell);
+
+			/* Previous table block ends where this one starts */
+			t->off = p->pos + (line - p->base);
+			if (p->t) {
+				p->t->next = t;
+				p->t->len = t->off - p->t->off;
+			} else
+				p->tables = t;
+
+			p->t = t;
+
+			if (!last)
+				return perr(p, "Unexpected cell after table %s name", t->name);
+
+			p->state = COLS;
+			break;
+		case COLS:
+			t->cols[i] = storez(&t->arena, cell, str - cell);
+			if (!t->cols[i])
+				return perr(p, "Failed to store column of table %s", t->name);
+
+			t->cn++;
+			t->width[i] = utf8len(t->cols[i]);
+			if (last)
+				p->state = ROWS;
+			break;
+		case ROWS:
+			if (i >= t->cn)
+				return perr(p, "More cells than columns in table %s", t->name);
+
+			t->cells[i][r] = intern(t, i, cell, str - cell);
+			if (!t->cells[i][r])
+				return perr(p, "Failed to store cell of table %s", t->name);
+
+			break;
+		}
+
+		if (last)
+			break;
+	}
+
+	/* Missing cells at the end of row are empty */
+	if (r != -1)
+		for (i++; i < t->cn; i++)
+			if (!(t->cells[i][r] = intern(t, i, EMPTY, sizeof EMPTY -1)))
+				return perr(p, "Failed to store cell of table %s", t->name);
+
+	return next == end ? end : next +1;
+}
+
+static void *
+parse_block(void *arg)
+{
+	struct parser *p;
+	char *str;
+
+	p = arg;
+	p->state = TABLE;
+
+	for (str = p->str; str && str < p->end;)
+		str = parse_line(p, str, p->end);
+
+	/* Last table block can be copied only when it ends with empty
+	 * line separating it from whatever will be written after. */
+	if (p->t)
+		p->t->len = p->blank ? p->pos + (p->end - p->base) - p->t->off : 0;
+
+	return 0;
+}
+
+/* Return beginning of next table block after STR or END. */
+static char *
+block_next(char *str, char *end)
+{
+	char *eol;
+	int blank;
+
+	/* Skip rest of current line, it could be in the middle */
+	str = line_end(str, end);
+	if (str < end)
+		str++;
+
+	for (blank = 0; str < end; str = eol +1) {
+		eol = line_end(str, end);
+
+		if (skip_spaces(str, eol) == eol)
+			blank = 1;
+		else if (blank)
+			return str;
+	}
+
+	return end;
+}
+
+/* Run FN on N elements of SZ size from ARGS array, each in its own
+ * thread with first one run in calling thread. */
+static void
+parallel(void *(*fn)(void *), void *args, size_t sz, int n)
+{
+	pthread_t th[TMAX];
+	int i, j;
+
+	for (i=1; i<n; i++)
+		if (pthread_create(&th[i], 0, fn, (char *)args + i*sz))
+			break;
+
+	(*fn)(args);
+
+	for (j=1; j<i; j++)
+		pthread_join(th[j], 0);
+
+	/* Run what didn't get its own thread */
+	for (; i<n; i++)
+		(*fn)((char *)args + i*sz);
+}
+
+/* Table blocks are separated by empty lines and don't depend on each
+ * other so file is split to as many parts as there are processors, each
+ * part parsed by separate thread. */
+static char *
+parse(struct boruta_db *db, char *str, size_t len)
+{
+	struct parser *p;
+	char *why, *end;
+	long cpus;
+	int i, n;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = len / PMIN;
+	if (n > cpus)
+		n = cpus;
+	if (n > TMAX)
+		n = TMAX;
+	if (n < 1)
+		n = 1;
+
+	p = calloc(n, sizeof *p);
+	if (!p)
+		return "Failed to allocate memory for parser";
+
+	end = str + len;
+	for (i=0; i<n; i++) {
+		p[i].base = str;
+		p[i].str = i ? p[i-1].end : str;
+		p[i].end = i == n-1 ? end :
+			block_next(str + len / n * (i+1), end);
+		if (p[i].end < p[i].str)
+			p[i].end = p[i].str;
+	}
+
+	parallel(parse_block, p, sizeof *p, n);
+	why = parse_link(db, p, n);
+	free(p);
+	return why;
+}
+
+/* Add tables of N parsers from P to catalog in file order until first
+ * error.  Tables after error are freed. */
+static char *
+parse_link(struct boruta_db *db, struct parser *p, int n)
+{
+	struct table *t, *next;
+	char *why;
+	int i;
+
+	why = 0;
+	for (i=0; i<n; i++) {
+		for (t = p[i].tables; t; t = next) {
+			next = t->next;
+
+			if (!why && table_get(db, t->name))
+				why = msg(db->err, "Table %s already exist", t->name);
+
+			if (!why && table_link(db, t))
+				why = msg(db->err, "Failed to add table %s", t->name);
+
+			if (why)
+				table_free(t);
+		}
+
+		if (!why && p[i].why)
+			why = msg(db->err, "%s", p[i].why);
+	}
+
+	return why;
+}
+
+/* Parse file FD reading it in SCHUNK sized chunks so only parsed
+ * tables and one chunk are in memory.  Partial line at the end of
+ * chunk is moved to the beginning of buffer and completed by next
+ * read.  Buffer grows only for lines longer than itself. */
+static char *
+stream(struct boruta_db *db, int fd)
+{
+	struct parser p = {0};
+	char *buf, *tmp, *str, *end, *eol = 0;
+	size_t sz, n;
+	ssize_t got;
+
+	sz = SCHUNK;
+	buf = malloc(sz);
+	if (!buf)
+		return "Failed to allocate memory for stream";
+
+	p.state = TABLE;
+	for (n = 0; !p.why;) {
+		if (n == sz) {
+			tmp = realloc(buf, sz *= 2);
+			if (!tmp) {
+				p.why = "Failed to allocate memory for stream";
+				break;
+			}
+			buf = tmp;
+		}
+
+		got = read(fd, buf + n, sz - n);
+		if (got == -1) {
+			p.why = "Failed to read file";
+			break;
+		}
+
+		n += got;
+		end = buf + n;
+
+		/* Parse only complete lines, unless it's end of file */
+		if (got) {
+			for (eol = end; eol > buf && eol[-1] != '\n'; eol--);
+			if (eol == buf)
+				continue;
+		} else
+			eol = end;
+
+		p.base = buf;
+		for (str = buf; str && str < eol;)
+			str = parse_line(&p, str, eol);
+
+		if (!got || !str)
+			break;
+
+		p.pos += eol - buf;
+		n = end - eol;
+		memmove(buf, eol, n);
+	}
+
+	if (p.t && !p.why)
+		p.t->len = p.blank ? p.pos + (eol - buf) - p.t->off : 0;
+
+	free(buf);
+	return parse_link(db, &p, 1);
+}
+
+/* Write whole O buffer to its file. */
+static void
+out_flush(struct out *o)
+{
+	ssize_t n;
+	char *str;
+
+	for (str = o->buf; !o->fail && str < o->buf + o->n; str += n)
+		if ((n = write(o->fd, str, o->buf + o->n - str)) == -1)
+			o->fail = 1;
+
+	o->pos += o->n;
+	o->n = 0;
+}
+
+/* Copy LEN bytes at OFF of FD file to O.  Kernel copies file ranges
+ * without passing them through user space where it can. */
+static void
+out_copy(struct out *o, int fd, off_t off, off_t len)
+{
+	ssize_t n;
+
+	out_flush(o);
+
+#ifdef __linux__
+	for (; !o->fail && len; len -= n, o->pos += n)
+		if ((n = copy_file_range(fd, &off, o->fd, 0, len, 0)) <= 0)
+			break;
+#endif
+	/* Fallback for systems and file systems without it */
+	for (; !o->fail && len; len -= n, off += n) {
+		n = pread(fd, o->buf, len < WCHUNK ? len : WCHUNK, off);
+		if (n <= 0) {
+			o->fail = 1;
+			break;
+		}
+		o->n = n;
+		out_flush(o);
+	}
+}
+
+static void
+out_put(struct out *o, char *str, size_t len)
+{
+	size_t n;
+
+	for (; len; str += n, len -= n) {
+		if (o->n == WCHUNK)
+			out_flush(o);
+
+		n = WCHUNK - o->n;
+		if (n > len)
+			n = len;
+
+		memcpy(o->buf + o->n, str, n);
+		o->n += n;
+	}
+}
+
+/* Put N spaces to O. */
+static void
+out_pad(struct out *o, size_t n)
+{
+	size_t m;
+
+	for (; n; n -= m) {
+		if (o->n == WCHUNK)
+			out_flush(o);
+
+		m = WCHUNK - o->n;
+		if (m > n)
+			m = n;
+
+		memset(o->buf + o->n, ' ', m);
+		o->n += m;
+	}
+}
+
+/* Remember PATH file of FS stats as file that database is same as,
+ * or forget it when PATH is null.  Tables are clean after that. */
+static void
+synced_set(struct boruta_db *db, char *path, struct stat *fs)
+{
+	struct table *t;
+
+	free(db->synced);
+	db->synced = 0;
+	db->dropped = 0;
+
+	if (!path)
+		return;
+
+	/* Without copy database is considered dirty. */
+	db->synced = malloc(strlen(path) +1);
+	if (!db->synced)
+		return;
+
+	strcpy(db->synced, path);
+	db->synced_fs = *fs;
+
+	for (t = db->tables; t; t = t->next)
+		t->dirty = 0;
+}
+
+/* Return non 0 when FD is same, unmodified file as SYNCED one. */
+static int
+synced_same(struct boruta_db *db, int fd)
+{
+	struct stat fs;
+
+	if (fstat(fd, &fs))
+		return 0;
+
+	return fs.st_dev == db->synced_fs.st_dev &&
+		fs.st_ino == db->synced_fs.st_ino &&
+		fs.st_size == db->synced_fs.st_size &&
+		fs.st_mtim.tv_sec == db->synced_fs.st_mtim.tv_sec &&
+		fs.st_mtim.tv_nsec == db->synced_fs.st_mtim.tv_nsec;
+}
+
+/* Write database to temporary file next to PATH, flush it to disk
+ * and rename over PATH, so PATH always has old or new content whole.
+ * Nothing is written when neither database nor PATH changed since
+ * PATH was loaded or written.  Blocks of clean tables are copied from PATH
+ * without serializing them again, so cost depends on changes size. */
+static char *
+write_atomic(struct boruta_db *db, char *path)
+{
+	struct out o;
+	struct table *t;
+	struct stat fs;
+	char *tmp, *dir, *slash;
+	mode_t mask;
+	off_t off;
+	int fd, src;
+
+	/* File stats change with INPLACE writes */
+	if (inplace_flush(db))
+		return "Failed to sync mapped file";
+
+	src = -1;
+	if (db->synced && !strcmp(db->synced, path) &&
+	    (src = open(path, O_RDONLY)) != -1 && !synced_same(db, src)) {
+		close(src);
+		src = -1;
+	}
+
+	if (src != -1) {
+		for (t = db->tables; t && !t->dirty; t = t->next);
+		if (!t && !db->dropped) {
+			close(src);
+			return 0;
+		}
+	}
+
+	tmp = malloc(strlen(path) + sizeof ".XXXXXX");
+	if (!tmp) {
+		if (src != -1)
+			close(src);
+		return "Failed to allocate memory for file path";
+	}
+
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	if ((o.fd = mkstemp(tmp)) == -1) {
+		if (src != -1)
+			close(src);
+		free(tmp);
+		return msg(db->err, "Failed to create temporary file for '%s'", path);
+	}
+
+	/* Keep target mode or use default one, mkstemp() gives 0600 */
+	if (stat(path, &fs) == 0)
+		fchmod(o.fd, fs.st_mode & 07777);
+	else {
+		mask = umask(0);
+		umask(mask);
+		fchmod(o.fd, 0666 & ~mask);
+	}
+
+	o.fail = 0;
+	o.pos = 0;
+	o.n = 0;
+
+	if (!(o.buf = malloc(WCHUNK)))
+		o.fail = 1;
+
+	/* Blocks get offsets in new file right away, in case of failure
+	 * SYNCED is forgotten so they are not used. */
+	for (t = db->tables; t && !o.fail; t = t->next) {
+		off = o.pos + o.n;
+		if (src != -1 && !t->dirty && t->len)
+			out_copy(&o, src, t->off, t->len);
+		else
+			out_table(&o, t);
+
+		t->off = off;
+		t->len = o.pos + o.n - off;
+	}
+
+	out_flush(&o);
+	free(o.buf);
+
+	if (src != -1)
+		close(src);
+
+	if (fsync(o.fd) || fstat(o.fd, &fs))
+		o.fail = 1;
+
+	/* Records logged so far are in file once it's renamed */
+	if (!o.fail && db->wal.fd != -1 && !strcmp(path, db->wal.db) &&
+	    wal_mark(db, &fs))
+		o.fail = 1;
+
+	if (close(o.fd) || o.fail || rename(tmp, path)) {
+		remove(tmp);
+		free(tmp);
+		synced_set(db, 0, 0);
+		return msg(db->err, "Failed to write file '%s'", path);
+	}
+
+	/* Rename is durable only after directory is flushed too */
+	slash = strrchr(tmp, '/');
+	dir = slash == tmp ? "/" : slash ? tmp : ".";
+	if (slash)
+		*slash = 0;
+
+	if ((fd = open(dir, O_RDONLY)) != -1) {
+		fsync(fd);
+		close(fd);
+	}
+
+	free(tmp);
+
+	synced_set(db, path, &fs);
+
+	/* Mapping still points at replaced file */
+	return db->inplace.path && !strcmp(db->inplace.path, path) ?
+		inplace_open(db, path) : 0;
+}
+
+/* Append LEN bytes of STR to log record being built. */
+static void
+wal_put(struct boruta_db *db, char *str, size_t len)
+{
+	size_t cap;
+	char *buf;
+
+	if (db->wal.n + len > db->wal.cap) {
+		for (cap = db->wal.cap ? db->wal.cap : 256; cap < db->wal.n + len; cap *= 2);
+
+		if (!(buf = realloc(db->wal.buf, cap))) {
+			db->wal.fail = 1;
+			return;
+		}
+
+		db->wal.buf = buf;
+		db->wal.cap = cap;
+	}
+
+	memcpy(db->wal.buf + db->wal.n, str, len);
+	db->wal.n += len;
+}
+
+/* Numbers are stored little endian regardless of machine. */
+static void
+wal_u32(struct boruta_db *db, unsigned v)
+{
+	char b[4];
+
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+	b[3] = v >> 24;
+	wal_put(db, b, 4);
+}
+
+static void
+wal_str(struct boruta_db *db, char *str)
+{
+	size_t len;
+
+	len = str ? strlen(str) : 0;
+	wal_u32(db, len);
+	if (len)
+		wal_put(db, str, len);
+}
+
+/* Start record of OP for TABLE.  Record is length and hash of its
+ * body, body starts with OP byte and table name. */
+static void
+wal_begin(struct boruta_db *db, int op, char *table)
+{
+	char c;
+
+	c = op;
+	db->wal.n = 0;
+	db->wal.fail = 0;
+	wal_u32(db, 0);
+	wal_u32(db, 0);
+	wal_put(db, &c, 1);
+	wal_str(db, table);
+}
+
+/* Append built record to log with single write, so record is never
+ * mixed with other, and fsync every SYNC_N records. */
+static char *
+wal_end(struct boruta_db *db)
+{
+	unsigned len, h;
+	ssize_t n;
+	char *str;
+
+	if (db->wal.fail)
+		return "Failed to allocate memory for log record";
+
+	len = db->wal.n - 8;
+	h = hashn(db->wal.buf + 8, len);
+	db->wal.n = 0;
+	wal_u32(db, len);
+	wal_u32(db, h);
+	db->wal.n = len + 8;
+
+	for (str = db->wal.buf; str < db->wal.buf + db->wal.n; str += n)
+		if ((n = write(db->wal.fd, str, db->wal.buf + db->wal.n - str)) == -1)
+			return "Failed to write log";
+
+	if (db->sync_n && ++db->wal.pending >= db->sync_n) {
+		db->wal.pending = 0;
+		if (fdatasync(db->wal.fd))
+			return "Failed to sync log";
+	}
+
+	return 0;
+}
+
+static char *
+wal_create(struct table *t)
+{
+	struct boruta_db *db;
+	int i;
+
+	db = t->db;
+	if (db->wal.fd == -1)
+		return 0;
+
+	wal_begin(db, 'C', t->name);
+	wal_u32(db, t->cn);
+	for (i=0; i < t->cn; i++)
+		wal_str(db, t->cols[i]);
+
+	return wal_end(db);
+}
+
+static char *
+wal_insert(struct table *t, int r)
+{
+	struct boruta_db *db;
+	int i;
+
+	db = t->db;
+	if (db->wal.fd == -1)
+		return 0;
+
+	wal_begin(db, 'I', t->name);
+	wal_u32(db, t->cn);
+	for (i=0; i < t->cn; i++)
+		wal_str(db, t->cells[i][r]);
+
+	return wal_end(db);
+}
+
+/* SET and DEL are logged with rows they matched instead of filters,
+ * replay runs on same rows as they are in same order. */
+static char *
+wal_set(struct table *t, char **new, int *rows, int n)
+{
+	struct boruta_db *db;
+	int i, k;
+
+	db = t->db;
+	if (db->wal.fd == -1)
+		return 0;
+
+	for (k=0, i=0; i < t->cn; i++)
+		if (new[i])
+			k++;
+
+	wal_begin(db, 'S', t->name);
+	wal_u32(db, k);
+	for (i=0; i < t->cn; i++)
+		if (new[i]) {
+			wal_u32(db, i);
+			wal_str(db, new[i]);
+		}
+
+	wal_u32(db, n);
+	for (i=0; i<n; i++)
+		wal_u32(db, rows[i]);
+
+	return wal_end(db);
+}
+
+static char *
+wal_del(struct table *t, int *rows, int n)
+{
+	struct boruta_db *db;
+	int i;
+
+	db = t->db;
+	if (db->wal.fd == -1)
+		return 0;
+
+	wal_begin(db, 'X', t->name);
+	wal_u32(db, n);
+	for (i=0; i<n; i++)
+		wal_u32(db, rows[i]);
+
+	return wal_end(db);
+}
+
+/* Log drop of TABLE or of all tables when TABLE is null. */
+static char *
+wal_drop(struct boruta_db *db, char *table)
+{
+	if (db->wal.fd == -1)
+		return 0;
+
+	wal_begin(db, 'D', table);
+	return wal_end(db);
+}
+
+/* Log that records before this one are in database file of FS
+ * stats.  Log starts with mark of file it was truncated for and has
+ * mark of new file before it is renamed to database path, so crash
+ * before truncate leaves records that replay skips. */
+static char *
+wal_mark(struct boruta_db *db, struct stat *fs)
+{
+	unsigned long long dev, ino;
+	char *why;
+
+	dev = fs->st_dev;
+	ino = fs->st_ino;
+	wal_begin(db, 'K', 0);
+	wal_u32(db, dev);
+	wal_u32(db, dev >> 32);
+	wal_u32(db, ino);
+	wal_u32(db, ino >> 32);
+	if ((why = wal_end(db)))
+		return why;
+
+	/* Mark has to be on disk before file is renamed */
+	return fdatasync(db->wal.fd) ? "Failed to sync log" : 0;
+}
+
+/* Write database to PATH that log starts from.  Log refers to rows
+ * by number and file has no deleted rows, so they are removed from
+ * tables first to keep numbers the same after load. */
+static char *
+wal_base(struct boruta_db *db, char *path)
+{
+	struct table *t;
+
+	for (t = db->tables; t; t = t->next) {
+		if (!t->dn)
+			continue;
+
+		if (table_compact(t))
+			return "Failed to allocate memory for deleted rows";
+
+		t->gen = ++db->gen;
+	}
+
+	return write_atomic(db, path);
+}
+
+/* Empty log that starts from database file written to its path. */
+static char *
+wal_truncate(struct boruta_db *db)
+{
+	if (db->wal.fd == -1)
+		return 0;
+
+	db->wal.pending = 0;
+	if (ftruncate(db->wal.fd, 0) || fsync(db->wal.fd))
+		return "Failed to truncate log";
+
+	/* Log of other file is not replayed on this one */
+	return db->synced && !strcmp(db->synced, db->wal.db) ?
+		wal_mark(db, &db->synced_fs) : 0;
+}
+
+static void
+wal_close(struct boruta_db *db)
+{
+	if (db->wal.fd != -1) {
+		fsync(db->wal.fd);
+		close(db->wal.fd);
+	}
+
+	free(db->wal.db);
+	free(db->wal.buf);
+	db->wal.fd = -1;
+	db->wal.db = 0;
+	db->wal.buf = 0;
+	db->wal.n = db->wal.cap = 0;
+	db->wal.pending = 0;
+}
+
+static unsigned
+wal_rd_u32(struct wal_rd *rd)
+{
+	unsigned char *b;
+
+	if (rd->end - rd->str < 4) {
+		rd->bad = 1;
+		return 0;
+	}
+
+	b = (unsigned char *)rd->str;
+	rd->str += 4;
+	return b[0] | b[1] << 8 | b[2] << 16 | (unsigned)b[3] << 24;
+}
+
+/* Read string from RD to A memory. */
+static char *
+wal_rd_str(struct wal_rd *rd, struct arena *a)
+{
+	unsigned len;
+	char *str;
+
+	len = wal_rd_u32(rd);
+	if (rd->bad || len > (size_t)(rd->end - rd->str)) {
+		rd->bad = 1;
+		return 0;
+	}
+
+	str = storez(a, rd->str, len);
+	rd->str += len;
+	if (!str)
+		rd->bad = 1;
+
+	return str;
+}
+
+/* Read next whole record of RD to BODY that starts after op byte.
+ * Return op or 0 at log end. */
+static int
+wal_rd_next(struct wal_rd *rd, struct wal_rd *body)
+{
+	unsigned len, h;
+
+	len = wal_rd_u32(rd);
+	h = wal_rd_u32(rd);
+
+	if (rd->bad || len < 1 || len > (size_t)(rd->end - rd->str) ||
+	    h != hashn(rd->str, len))
+		return 0;
+
+	body->str = rd->str + 1;
+	body->end = rd->str + len;
+	body->bad = 0;
+	rd->str += len;
+	return (unsigned char)body->str[-1];
+}
+
+/* Return nonzero when mark record BODY is of file with FS stats. */
+static int
+wal_rd_mark(struct wal_rd *body, struct stat *fs)
+{
+	unsigned long long dev, ino;
+
+	if (wal_rd_u32(body))	/* Empty table name */
+		return 0;
+
+	dev = wal_rd_u32(body);
+	dev |= (unsigned long long)wal_rd_u32(body) << 32;
+	ino = wal_rd_u32(body);
+	ino |= (unsigned long long)wal_rd_u32(body) << 32;
+
+	return !body->bad && dev == (unsigned long long)fs->st_dev &&
+		ino == (unsigned long long)fs->st_ino;
+}
+
+/* Apply log record of OP with body in RD using Q words and memory. */
+static char *
+wal_apply(struct query *q, int op, struct wal_rd *rd)
+{
+	struct table *t;
+	char *str, *new[CMAX] = {0};
+	unsigned i, k, n;
+	int *rows;
+
+	str = wal_rd_str(rd, &q->tmp);
+	if (!str)
+		return "Corrupted log";
+
+	q->tname = *str ? str : 0;
+	q->table = t = *str ? table_get(q->db, str) : 0;
+
+	if (op != 'C' && op != 'D' && !t)
+		return msg(q->db->err, "Log refers to missing table %s", str);
+
+	switch (op) {
+	case 'C':
+		n = wal_rd_u32(rd);
+		if (n >= CMAX)
+			return "Corrupted log";
+
+		for (i=0; !rd->bad && i<n; i++)
+			push(q, wal_rd_str(rd, &q->tmp));
+		return rd->bad ? "Corrupted log" : Create(q);
+	case 'D':
+		return Drop(q);
+	case 'I':
+		n = wal_rd_u32(rd);
+		if (n != (unsigned)t->cn)
+			return "Corrupted log";
+
+		/* Insert takes "value column" pairs from stack */
+		for (i=0; !rd->bad && i<n; i++) {
+			push(q, wal_rd_str(rd, &q->tmp));
+			push(q, t->cols[i]);
+		}
+		return rd->bad ? "Corrupted log" : Insert(q);
+	case 'S':
+		k = wal_rd_u32(rd);
+		for (; !rd->bad && k; k--) {
+			i = wal_rd_u32(rd);
+			if (i >= (unsigned)t->cn)
+				return "Corrupted log";
+			new[i] = wal_rd_str(rd, &q->tmp);
+		}
+		/* Fall through */
+	case 'X':
+		n = wal_rd_u32(rd);
+		if (rd->bad || n > (size_t)(rd->end - rd->str) / 4)
+			return "Corrupted log";
+
+		rows = (int *)store(&q->tmp, 0, n * sizeof *rows + 1);
+		if (!rows)
+			return "Failed to allocate memory for log rows";
+
+		for (i=0; i<n; i++)
+			if ((unsigned)(rows[i] = wal_rd_u32(rd)) >= (unsigned)t->rn ||
+			    !LIVE(t, rows[i]))
+				return "Corrupted log";
+
+		return op == 'S' ? table_set(t, new, rows, n) :
+			table_del(t, rows, n);
+	}
+
+	return "Corrupted log";
+}
+
+/* Apply mutations logged in PATH.wal to loaded database.  Log ends
+ * at first record that is not whole, as write of it never finished.
+ * Records before last mark of PATH file are already in it and log
+ * with marks of other files only was replaced by PATH file. */
+static char *
+wal_replay(struct boruta_db *db, char *path)
+{
+	struct query q = {0};
+	struct wal_rd rd, body;
+	struct stat fs, base;
+	char *why, *str, *start, p[PATH_MAX];
+	int fd, wfd, op, marks;
+
+	q.db = db;
+	snprintf(p, sizeof p, "%s.wal", path);
+	if ((fd = open(p, O_RDONLY)) == -1)
+		return 0;	/* No log, nothing to replay */
+
+	if (fstat(fd, &fs) == -1) {
+		close(fd);
+		return "Failed to read log stats";
+	}
+
+	if (fs.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	str = mmap(0, fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (str == MAP_FAILED)
+		return "Failed to map log";
+
+	if (stat(path, &base) == -1) {
+		munmap(str, fs.st_size);
+		return "Failed to read database file stats";
+	}
+
+	rd.str = str;
+	rd.end = str + fs.st_size;
+	rd.bad = 0;
+
+	for (start = 0, marks = 0; (op = wal_rd_next(&rd, &body));)
+		if (op == 'K') {
+			marks = 1;
+			if (wal_rd_mark(&body, &base))
+				start = rd.str;
+		}
+
+	rd.str = start ? start : marks ? rd.end : str;
+	rd.bad = 0;
+
+	/* Replayed mutations are already in log. */
+	wfd = db->wal.fd;
+	db->wal.fd = -1;
+	why = 0;
+
+	while (!why && (op = wal_rd_next(&rd, &body)))
+		if (op != 'K') {
+			q.si = 0;
+			why = wal_apply(&q, op, &body);
+		}
+
+	db->wal.fd = wfd;
+	arena_free(&q.tmp);
+	munmap(str, fs.st_size);
+
+	return why;
+}
+
+/* Map PATH file for INPLACE SET, replacing previous mapping. */
+static char *
+inplace_open(struct boruta_db *db, char *path)
+{
+	struct table *t;
+	struct stat fs;
+	char *why;
+	int fd;
+
+	inplace_close(db);
+
+	for (t = db->tables; t; t = t->next) {
+		free(t->rowoff);
+		t->rowoff = 0;
+	}
+
+	if ((fd = open(path, O_RDWR)) == -1 || fstat(fd, &fs) == -1) {
+		why = msg(db->err, "Failed to open file '%s'", path);
+		if (fd != -1)
+			close(fd);
+		return why;
+	}
+
+	if (!(db->inplace.path = malloc(strlen(path) +1))) {
+		close(fd);
+		return "Failed to allocate memory for file path";
+	}
+
+	strcpy(db->inplace.path, path);
+
+	db->inplace.fd = fd;
+	db->inplace.sz = fs.st_size;
+	db->inplace.map = 0;
+
+	if (!db->inplace.sz)
+		return 0;
+
+	db->inplace.map = mmap(0, db->inplace.sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (db->inplace.map == MAP_FAILED) {
+		why = msg(db->err, "Failed to map file '%s'", path);
+		db->inplace.map = 0;
+		inplace_close(db);
+		return why;
+	}
+
+	return 0;
+}
+
+static void
+inplace_close(struct boruta_db *db)
+{
+	inplace_flush(db);
+
+	if (db->inplace.map)
+		munmap(db->inplace.map, db->inplace.sz);
+
+	if (db->inplace.fd != -1)
+		close(db->inplace.fd);
+
+	free(db->inplace.path);
+	db->inplace.path = 0;
+	db->inplace.map = 0;
+	db->inplace.sz = 0;
+	db->inplace.fd = -1;
+}
+
+/* Write changed rows to disk.  File modification time changes with
+ * that, so it's taken again to keep file recognized as synced. */
+static char *
+inplace_flush(struct boruta_db *db)
+{
+	if (!db->inplace.pending)
+		return 0;
+
+	db->inplace.pending = 0;
+
+	if (msync(db->inplace.map, db->inplace.sz, MS_SYNC))
+		return "Failed to sync mapped file";
+
+	if (db->synced && !strcmp(db->synced, db->inplace.path))
+		fstat(db->inplace.fd, &db->synced_fs);
+
+	return 0;
+}
+
+/* Find rows lines of table T in mapped file.  Return 0 on success. */
+static int
+inplace_rows(struct table *t)
+{
+	struct boruta_db *db;
+	char *str, *end, *eol;
+	int r;
+
+	db = t->db;
+	if (t->rowoff)
+		return 0;
+
+	if (!t->len || t->off + t->len > (off_t)db->inplace.sz)
+		return -1;
+
+	t->rowoff = malloc((t->rn +1) * sizeof *t->rowoff);
+	if (!t->rowoff)
+		return -1;
+
+	str = db->inplace.map + t->off;
+	end = str + t->len;
+
+	/* Skip table name and columns lines, deleted rows are not in
+	 * file so lines are assigned to remaining rows */
+	for (r = -2; str < end && r <= t->rn; str = eol +1) {
+		eol = memchr(str, '\n', end - str);
+		if (!eol)
+			eol = end;
+
+		if (skip_spaces(str, eol) == eol)
+			continue;	/* Empty line after rows */
+
+		while (r >= 0 && r < t->rn && !LIVE(t, r))
+			r++;
+
+		if (r >= 0 && r < t->rn)
+			t->rowoff[r] = str - db->inplace.map;
+		r++;
+	}
+
+	while (r >= 0 && r < t->rn && !LIVE(t, r))
+		r++;
+
+	if (r != t->rn) {
+		free(t->rowoff);
+		t->rowoff = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Return beginning of COL cell of row R in mapped file and set CAP
+ * to size of its slot, that is cell with padding it can take without
+ * eating two spaces separator, last cell of row too.  Return null for
+ * missing cell. */
+static char *
+inplace_slot(struct table *t, int r, int col, size_t *cap)
+{
+	struct boruta_db *db;
+	char *str, *end, *next, *cell;
+	int i;
+
+	db = t->db;
+	str = db->inplace.map + t->rowoff[r];
+	end = memchr(str, '\n', db->inplace.map + db->inplace.sz - str);
+	if (!end)
+		end = db->inplace.map + db->inplace.sz;
+
+	str = skip_spaces(str, end);
+	for (i=0; i < col && str < end; i++)
+		str = skip_spaces((*cell_end)(str, end), end);
+
+	if (str == end)
+		return 0;
+
+	cell = (*cell_end)(str, end);
+	next = skip_spaces(cell, end);
+	if (next == end)
+		next = end - str < cell - str + 2 ? cell + 2 : end;
+
+	*cap = next - str - 2;
+	return str;
+}
+
+/* Write interned values V of not null columns in N ROWS of table T
+ * in place of old ones in mapped synced file.  Return 0 when any of
+ * them doesn't fit its slot, then file is not changed at all. */
+static int
+inplace_set(struct table *t, char **v, int *rows, int n)
+{
+	struct boruta_db *db;
+	struct str *p;
+	char *str;
+	size_t cap;
+	int i, j, pass;
+
+	db = t->db;
+	if (!db->inplace.map || !db->synced || strcmp(db->synced, db->inplace.path))
+		return 0;
+
+	if (inplace_rows(t))
+		return 0;
+
+	/* Values that would not parse back as single cell never fit */
+	for (i=0; i < t->cn; i++) {
+		if (!v[i])
+			continue;
+
+		p = CELL(v[i]);
+		if (!p->len || p->s[0] == ' ' || p->s[p->len -1] == ' ' ||
+		    strchr(p->s, '\n') || strstr(p->s, "  "))
+			return 0;
+	}
+
+	/* First pass checks, second one writes */
+	for (pass = 0; pass < 2; pass++)
+		for (j=0; j<n; j++)
+			for (i=0; i < t->cn; i++) {
+				if (!v[i])
+					continue;
+
+				p = CELL(v[i]);
+				/* Slot is as wide as column in file */
+				str = inplace_slot(t, rows[j], i, &cap);
+				if (!str || cap < (size_t)p->len ||
+				    (*utf8n)(str, cap) < p->w)
+					return 0;
+
+				if (pass) {
+					memcpy(str, p->s, p->len);
+					memset(str + p->len, ' ', cap - p->len);
+				}
+			}
+
+	db->inplace.pending += n;
+	if (db->sync_n && db->inplace.pending >= db->sync_n)
+		inplace_flush(db);
+
+	return 1;
+}
+
+/* Put table T to O in same format it is parsed from.  Cells are
+ * padded to column width using cached interned value length and
+ * width, so values are only copied. */
+static void
+out_table(struct out *o, struct table *t)
+{
+	struct str *v;
+	int i, r;
+
+	out_put(o, t->name, strlen(t->name));
+	out_put(o, "\n", 1);
+
+	for (i=0; i < t->cn; i++) {
+		out_put(o, t->cols[i], strlen(t->cols[i]));
+		out_pad(o, t->width[i] - utf8len(t->cols[i]) + 2);
+	}
+	out_put(o, "\n", 1);
+
+	for (r=0; r < t->rn; r++) {
+		if (!LIVE(t, r))
+			continue;
+
+		for (i=0; i < t->cn; i++) {
+			v = CELL(t->cells[i][r]);
+			out_put(o, v->s, v->len);
+			out_pad(o, t->width[i] - v->w + 2);
+		}
+		out_put(o, "\n", 1);
+	}
+	out_put(o, "\n", 1);
+}
+
+static void
+push(struct query *query, char *word)
+{
+	query->stack[query->si++] = word;
+}
+
+static char *
+pop(struct query *query)
+{
+	return query->si ? query->stack[--(query->si)] : 0;
+}
+
+static char *
+next(char **cp)
+{
+	char terminate, *word;
+
+	*cp = skip_whitespaces(*cp);
+	if (!**cp)
+		return 0;
+
+	switch (**cp) {
+	case '"': case '\'':	/* Explicite strings */
+		terminate = **cp;
+		(*cp)++;
+		break;
+	default:
+		terminate = ' ';
+	}
+
+	word = *cp;
+
+	while (**cp && **cp != '\n' && **cp != terminate)
+		(*cp)++;
+
+	/* TODO(irek): So ugly */
+	if (**cp) {
+		**cp = 0;
+		(*cp)++;
+	} else {
+		**cp = 0;
+	}
+
+	return word;
+}
+
+/* Give single ROW of CN columns to query callback. */
+static void
+row_out(struct query *query, int cn, char **cols, char **row)
+{
+	char **vals[CMAX];
+	int i, len[CMAX], *lens[CMAX];
+
+	if (!query->batch) {
+		(*query->cb)(query->ctx, 0, cn, cols, row);
+		return;
+	}
+
+	for (i=0; i<cn; i++) {
+		len[i] = strlen(row[i]);
+		vals[i] = &row[i];
+		lens[i] = &len[i];
+	}
+
+	(*query->batch)(query->ctx, 0, cn, cols, 1, vals, lens);
+}
+
+/* Give error WHY to query callback. */
+static void
+query_fail(struct query *query, char *why)
+{
+	if (query->batch)
+		(*query->batch)(query->ctx, why, 0, 0, 0, 0, 0);
+	else
+		(*query->cb)(query->ctx, why, 0, 0, 0);
+}
+
+/* Prepare B for BATCH rows of CN columns named COLS.  Return -1 when
+ * out of memory. */
+static int
+batch_init(struct batch *b, int cn, char **cols)
+{
+	int i;
+
+	b->mem = malloc(cn * BATCH * (sizeof **b->vals + sizeof **b->lens));
+	if (!b->mem)
+		return -1;
+
+	for (i=0; i<cn; i++) {
+		b->vals[i] = (char **)b->mem + i*BATCH;
+		b->lens[i] = (int *)((char **)b->mem + cn*BATCH) + i*BATCH;
+	}
+
+	b->n = 0;
+	b->cn = cn;
+	b->cols = cols;
+	return 0;
+}
+
+/* Rows are always collected in batches.  Callback of single row is
+ * called for each row of batch. */
+static void
+batch_flush(struct query *query, struct batch *b)
+{
+	char *row[CMAX];
+	int i, j;
+
+	if (!b->n)
+		return;
+
+	if (query->batch)
+		(*query->batch)(query->ctx, 0, b->cn, b->cols, b->n,
+		                b->vals, b->lens);
+	else
+		for (i=0; i < b->n; i++) {
+			for (j=0; j < b->cn; j++)
+				row[j] = b->vals[j][i];
+
+			(*query->cb)(query->ctx, 0, b->cn, b->cols, row);
+		}
+
+	b->n = 0;
+}
+
+/* Return index of column NAME of query table or CMAX + index of JOIN
+ * table column.  With JOIN name can have "table." prefix. */
+static int
+column_find(struct query *query, char *name)
+{
+	struct table *t[2];
+	size_t len;
+	int i, j;
+
+	if (!query->jt)
+		return column_indexof(query->table, name);
+
+	t[0] = query->table;
+	t[1] = query->jt;
+
+	for (i=0; i<2; i++) {
+		len = strlen(t[i]->name);
+		if (!strncmp(name, t[i]->name, len) && name[len] == '.') {
+			j = column_indexof(t[i], name + len +1);
+			return j == -1 ? -1 : i*CMAX + j;
+		}
+	}
+
+	if ((j = column_indexof(t[0], name)) != -1)
+		return j;
+
+	j = column_indexof(t[1], name);
+	return j == -1 ? -1 : CMAX + j;
+}
+
+static char *
+cond(struct query *query, char **dst, char **jdst)
+{
+	char *column, *value;
+	int i;
+
+	if (!query->table)
+		return "Undefined table";
+
+	while (1) {
+		column = pop(query);
+		value = pop(query);
+
+		if (!column)
+			break;	/* End, nothing more on stack */
+
+		if (!value)
+			return msg(query->err, "Missing value for column %s", column);
+
+		i = column_find(query, column);
+		if (i == -1)
+			return msg(query->err, "Column %s don't exist", column);
+
+		if (i < CMAX)
+			dst[i] = value;
+		else if (jdst)
+			jdst[i - CMAX] = value;
+		else
+			return msg(query->err, "Joined column %s can be filtered only with EQ and NEQ", column);
+	}
+
+	return 0;
+}
+
+static int
+filter(struct scan *s, int r)
+{
+	struct query *q;
+	int i;
+	char *str, *cell;
+
+	q = s->query;
+
+	for (i=0; i < q->table->cn; i++) {
+		cell = q->table->cells[i][r];
+
+		/* Interned values are equal only if it's the same cell */
+		str = s->eq[i];
+		if (str && str != cell)
+			return 1;
+
+		str = s->neq[i];
+		if (str && str == cell)
+			return 1;
+
+		str = q->lt[i];
+		if (str && compare(cell, str) >= 0)
+			return 1;
+
+		str = q->le[i];
+		if (str && compare(cell, str) > 0)
+			return 1;
+
+		str = q->gt[i];
+		if (str && compare(cell, str) <= 0)
+			return 1;
+
+		str = q->ge[i];
+		if (str && compare(cell, str) < 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+scan_init(struct scan *s, struct query *query)
+{
+	struct table *t;
+	struct key *k;
+	struct tree *tr;
+	char *str;
+	int i;
+
+	memset(s, 0, sizeof *s);
+	s->query = query;
+	s->col = -1;
+	t = query->table;
+
+	for (i=0; i < t->cn; i++) {
+		if (query->eq[i] && !(s->eq[i] = interned(t, i, query->eq[i])))
+			s->none = 1;
+
+		if (query->neq[i])
+			s->neq[i] = interned(t, i, query->neq[i]);
+	}
+
+	/* Sorted output is only possible by walking sorted index */
+	if (query->order) {
+		s->col = query->order -1;
+	} else {
+		/* Walk postings of the most selective indexed EQ column */
+		for (i=0; i < t->cn; i++) {
+			if (!query->eq[i] || !t->index[i])
+				continue;
+
+			k = index_find(t->index[i], query->eq[i]);
+			if (!k) {
+				s->indexed = 1;
+				s->post = s->pend = 0;
+				return;
+			}
+
+			if (!s->indexed || k->n < s->indexed) {
+				s->indexed = k->n;
+				s->post = k->rows;
+				s->pend = k->rows + k->n;
+			}
+		}
+
+		if (s->indexed)
+			return;
+
+		for (i=0; i < t->cn && s->col == -1; i++)
+			if (t->tree[i] && (query->eq[i] || query->lt[i] ||
+			    query->le[i] || query->gt[i] || query->ge[i]))
+				s->col = i;
+	}
+
+	if (s->col == -1) {
+		scan_par(s);
+		return;
+	}
+
+	/* Start from first value passing lower bound */
+	tr = t->tree[s->col];
+	if ((str = query->eq[s->col]) || (str = query->ge[s->col]))
+		s->node = tree_find(tr, str, -1, 0);
+	else if ((str = query->gt[s->col]))
+		s->node = tree_find(tr, str, INT_MAX, 0);
+	else
+		s->node = tr->head->next[0];
+}
+
+/* Full scan of big table is split to MORSEL rows ranges filtered by as
+ * many threads as there are processors.  Ranges are filtered in waves
+ * and rows of wave are returned in table order before next wave
+ * starts, so SKIP and LIMIT stop the scan after at most one wave of
+ * extra work. */
+static void
+scan_par(struct scan *s)
+{
+	long cpus;
+	int n;
+
+	if (s->query->table->rn <= MORSEL)
+		return;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = (s->query->table->rn + MORSEL-1) / MORSEL;
+	if (n > cpus)
+		n = cpus;
+	if (n > TMAX)
+		n = TMAX;
+	if (n < 1)
+		n = 1;
+
+	/* Without memory scan is done by calling thread */
+	s->m = malloc(n * sizeof *s->m);
+	s->mn = s->m ? n : 0;
+	s->mi = s->mn;	/* First wave on first scan_next() */
+	s->mpos = 0;
+}
+
+static void *
+scan_morsel(void *arg)
+{
+	struct morsel *m;
+	struct table *t;
+	int r;
+
+	m = arg;
+	t = m->s->query->table;
+
+	for (r = m->from; r < m->to; r++)
+		if (LIVE(t, r) && !filter(m->s, r))
+			m->rows[m->n++] = r;
+
+	return 0;
+}
+
+/* Filter next wave of morsels.  Return 0 when there are no more rows. */
+static int
+scan_wave(struct scan *s)
+{
+	int i, rn;
+
+	rn = s->query->table->rn;
+	for (i=0; i < s->mn && s->row < rn; i++) {
+		s->m[i].s = s;
+		s->m[i].n = 0;
+		s->m[i].from = s->row;
+		s->row += rn - s->row < MORSEL ? rn - s->row : MORSEL;
+		s->m[i].to = s->row;
+	}
+
+	if (i == 0)
+		return 0;
+
+	parallel(scan_morsel, s->m, sizeof *s->m, i);
+
+	/* Morsels past I are empty from previous wave or unused */
+	for (; i < s->mn; i++)
+		s->m[i].n = 0;
+
+	s->mi = s->mpos = 0;
+	return 1;
+}
+
+static void
+scan_free(struct scan *s)
+{
+	free(s->m);
+	s->m = 0;
+}
+
+/* Return next row passing filters or -1 on the end. */
+static int
+scan_next(struct scan *s)
+{
+	struct query *q;
+	int r, c;
+
+	q = s->query;
+
+	if (s->none)
+		return -1;
+
+	while (1) {
+		if (s->indexed) {
+			if (s->post == s->pend)
+				return -1;
+
+			r = *s->post++;
+		} else if (s->col != -1) {
+			if (!s->node)
+				return -1;
+
+			/* End on first value past upper bound */
+			c = q->eq[s->col] ? compare(s->node->str, q->eq[s->col]) :
+			    q->le[s->col] ? compare(s->node->str, q->le[s->col]) :
+			    q->lt[s->col] ? compare(s->node->str, q->lt[s->col]) +1 :
+			    0;
+			if (c > 0)
+				return -1;
+
+			r = s->node->row;
+			s->node = s->node->next[0];
+		} else if (s->m) {
+			while (s->mi < s->mn && s->mpos == s->m[s->mi].n) {
+				s->mi++;
+				s->mpos = 0;
+			}
+
+			if (s->mi < s->mn)
+				return s->m[s->mi].rows[s->mpos++];
+
+			if (!scan_wave(s))
+				return -1;
+
+			continue;
+		} else {
+			if (s->row == q->table->rn)
+				return -1;
+
+			r = s->row++;
+			if (!LIVE(q->table, r))
+				continue;
+		}
+
+		if (!filter(s, r))
+			return r;
+	}
+}
+
+/* SET and DEL collect all matching rows first so they can modify table
+ * and indexes without invalidating the scan.  Return array of N rows
+ * that has to be freed or 0 on error. */
+static int *
+matches(struct query *query, int *n)
+{
+	struct scan s;
+	int *rows, *tmp, r, cap;
+
+	cap = 64;
+	rows = malloc(cap * sizeof *rows);
+	if (!rows)
+		return 0;
+
+	*n = 0;
+	scan_init(&s, query);
+	while ((r = scan_next(&s)) != -1) {
+		if (*n == cap) {
+			cap *= 2;
+			tmp = realloc(rows, cap * sizeof *rows);
+			if (!tmp) {
+				scan_free(&s);
+				free(rows);
+				return 0;
+			}
+			rows = tmp;
+		}
+		rows[(*n)++] = r;
+	}
+
+	scan_free(&s);
+	return rows;
+}
+
+/* Make cursor C read rows of CN columns COLI of SELECT table instead
+ * of SELECT giving them to callback. */
+static char *
+cursor_select(struct boruta_cursor *c, int *coli, int cn)
+{
+	struct query *q;
+	int i;
+
+	q = &c->q;
+	if (c->t)
+		return "Cursor query can have single SELECT";
+
+	/* Column names have to outlive table */
+	for (i=0; i<cn; i++) {
+		c->coli[i] = coli[i];
+		c->cols[i] = store(&q->tmp, q->table->cols[coli[i]], -1);
+		if (!c->cols[i])
+			return "Failed to store column name";
+	}
+
+	c->t = q->table;
+	c->tname = q->tname;
+	c->cn = cn;
+	c->gen = c->t->gen;
+	c->catalog_gen = q->db->catalog_gen;
+	scan_init(&c->s, q);
+	return 0;
+}
+
+/* Copy values of row R to cursor C buffer. */
+static char *
+cursor_row(struct boruta_cursor *c, int r)
+{
+	char *cell, *tmp;
+	size_t sz;
+	int i;
+
+	for (sz=0, i=0; i < c->cn; i++)
+		sz += CELL(c->t->cells[c->coli[i]][r])->len +1;
+
+	if (sz > c->cap) {
+		tmp = realloc(c->buf, sz);
+		if (!tmp)
+			return "Failed to allocate memory for row";
+
+		c->buf = tmp;
+		c->cap = sz;
+	}
+
+	for (sz=0, i=0; i < c->cn; i++) {
+		cell = c->t->cells[c->coli[i]][r];
+		c->row[i] = memcpy(c->buf + sz, cell, CELL(cell)->len +1);
+		sz += CELL(cell)->len +1;
+	}
+
+	return 0;
+}
+
+/* Pop all column names from stack to CN columns indexes COLI in
+ * order they were pushed, "*" being all table columns.  Columns of JOIN
+ * table have CMAX added to index. */
+static char *
+columns(struct query *query, int *coli, int *cn)
+{
+	char *str;
+	int i, j;
+
+	for (i=CMAX; i>0;) {
+		str = pop(query);
+		if (!str)
+			break;
+
+		if (!strcmp(str, "*")) {
+			for (j = query->jt ? query->jt->cn : 0; j > 0 && i > 0;)
+				coli[--i] = CMAX + --j;
+			for (j = query->table->cn; j > 0 && i > 0;)
+				coli[--i] = --j;
+			continue;
+		}
+
+		j = column_find(query, str);
+		if (j == -1)
+			return msg(query->err, "Unknown column %s", str);
+
+		coli[--i] = j;
+	}
+
+	*cn = CMAX - i;
+	for (j=0; j < *cn; j++)
+		coli[j] = coli[i++];
+
+	return 0;
+}
+
+/* Add aggregate FN of column taken from stack, COUNT takes none. */
+static char *
+aggregate(struct query *query, int fn)
+{
+	char *column;
+	int col;
+
+	if (!query->table)
+		return "Undefined table";
+
+	if (query->an == CMAX)
+		return "Too many aggregates";
+
+	col = -1;
+	if (fn != ACOUNT) {
+		column = pop(query);
+		if (!column)
+			return "Missing column";
+
+		col = column_indexof(query->table, column);
+		if (col == -1)
+			return msg(query->err, "Column %s don't exist", column);
+	}
+
+	query->agg[query->an].fn = fn;
+	query->agg[query->an].col = col;
+	query->an++;
+	return 0;
+}
+
+/* Return output column name of I query aggregate like "sum(col)". */
+static char *
+agg_name(struct query *query, int i)
+{
+	static char *names[] = {"count", "sum", "min", "max", "avg"};
+	char buf[256];
+	int n;
+
+	if (query->agg[i].fn == ACOUNT)
+		return names[ACOUNT];
+
+	n = snprintf(buf, sizeof buf, "%s(%s)", names[query->agg[i].fn],
+	             query->table->cols[query->agg[i].col]);
+	if (n >= (int)sizeof buf)
+		n = sizeof buf -1;
+
+	return storez(&query->tmp, buf, n);
+}
+
+/* Cells are interned so group of GN columns is identified by cells
+ * pointers and its hash is made of values hashes that are already
+ * computed. */
+static struct group *
+group_get(struct query *query, struct groups *g, char **key, int gn)
+{
+	struct group *gr, **buckets, *next;
+	unsigned h, i, sz;
+
+	for (h = 2166136261u, i=0; i < (unsigned)gn; i++)
+		h = (h ^ CELL(key[i])->h) * 16777619u;
+
+	for (gr = g->sz ? g->buckets[h & (g->sz-1)] : 0; gr; gr = gr->next)
+		if (gr->h == h && !memcmp(gr->key, key, gn * sizeof *key))
+			return gr;
+
+	if (g->n >= g->sz) {
+		sz = g->sz ? g->sz * 2 : 64;
+		buckets = calloc(sz, sizeof *buckets);
+		if (!buckets)
+			return 0;
+
+		for (i=0; i < g->sz; i++)
+			for (gr = g->buckets[i]; gr; gr = next) {
+				next = gr->next;
+				gr->next = buckets[gr->h & (sz-1)];
+				buckets[gr->h & (sz-1)] = gr;
+			}
+
+		free(g->buckets);
+		g->buckets = buckets;
+		g->sz = sz;
+	}
+
+	gr = (struct group *)store(&query->tmp, 0, sizeof *gr + gn * sizeof *key);
+	if (!gr)
+		return 0;
+
+	gr->acc = (struct acc *)store(&query->tmp, 0, query->an * sizeof *gr->acc);
+	if (!gr->acc)
+		return 0;
+
+	memset(gr->acc, 0, query->an * sizeof *gr->acc);
+	memcpy(gr->key, key, gn * sizeof *key);
+	gr->h = h;
+	gr->next = g->buckets[h & (g->sz-1)];
+	g->buckets[h & (g->sz-1)] = gr;
+	g->n++;
+
+	gr->order = 0;
+	if (g->last)
+		g->last->order = gr;
+	else
+		g->first = gr;
+	g->last = gr;
+
+	return gr;
+}
+
+/* Add row R to aggregates of group GR.  NULL values are skipped. */
+static void
+group_add(struct query *query, struct group *gr, int r)
+{
+	struct acc *a;
+	char *cell;
+	double d;
+	int i;
+
+	for (i=0; i < query->an; i++) {
+		a = &gr->acc[i];
+
+		if (query->agg[i].fn == ACOUNT) {
+			a->n++;
+			continue;
+		}
+
+		cell = query->table->cells[query->agg[i].col][r];
+		if (!strcmp(cell, EMPTY))
+			continue;
+
+		switch (query->agg[i].fn) {
+		case ACOUNT:
+			break;
+		case ASUM:
+		case AAVG:
+			if (number(cell, &d)) {
+				a->sum += d;
+				a->n++;
+			}
+			break;
+		case AMIN:
+			if (!a->cell || compare(cell, a->cell) < 0)
+				a->cell = cell;
+			break;
+		case AMAX:
+			if (!a->cell || compare(cell, a->cell) > 0)
+				a->cell = cell;
+			break;
+		}
+	}
+}
+
+/* Put group GR of GN columns as next row of batch B. */
+static char *
+group_row(struct query *query, struct batch *b, struct group *gr, int gn)
+{
+	struct acc *a;
+	char *str, buf[64];
+	int i, n;
+
+	for (i=0; i<gn; i++) {
+		b->vals[i][b->n] = gr->key[i];
+		b->lens[i][b->n] = CELL(gr->key[i])->len;
+	}
+
+	for (i=0; i < query->an; i++) {
+		a = &gr->acc[i];
+		str = EMPTY;
+		n = -1;
+
+		switch (query->agg[i].fn) {
+		case ACOUNT:
+			n = snprintf(buf, sizeof buf, "%ld", a->n);
+			break;
+		case ASUM:
+			n = snprintf(buf, sizeof buf, "%.15g", a->sum);
+			break;
+		case AAVG:
+			if (a->n)
+				n = snprintf(buf, sizeof buf, "%.15g", a->sum / a->n);
+			break;
+		case AMIN:
+		case AMAX:
+			if (a->cell)
+				str = a->cell;
+			break;
+		}
+
+		if (n != -1 && !(str = storez(&query->tmp, buf, n)))
+			return "Failed to store aggregate";
+
+		b->vals[gn+i][b->n] = str;
+		b->lens[gn+i][b->n] = strlen(str);
+	}
+
+	return 0;
+}
+
+static void
+jscan_init(struct jscan *js, struct query *query)
+{
+	int i;
+
+	memset(js, 0, sizeof *js);
+	js->t = query->jt;
+
+	for (i=0; i < js->t->cn; i++) {
+		if (query->jeq[i] && !(js->eq[i] = interned(js->t, i, query->jeq[i])))
+			js->none = 1;
+
+		if (query->jneq[i])
+			js->neq[i] = interned(js->t, i, query->jneq[i]);
+	}
+}
+
+/* Return next row of JOIN table passing its filters or -1. */
+static int
+jscan_next(struct jscan *js)
+{
+	int i, r;
+
+	if (js->none)
+		return -1;
+
+	while ((r = js->row) < js->t->rn) {
+		js->row++;
+		if (!LIVE(js->t, r))
+			continue;
+
+		for (i=0; i < js->t->cn; i++)
+			if ((js->eq[i] && js->eq[i] != js->t->cells[i][r]) ||
+			    (js->neq[i] && js->neq[i] == js->t->cells[i][r]))
+				break;
+
+		if (i == js->t->cn)
+			return r;
+	}
+
+	return -1;
+}
+
+/* Same as matches() for JOIN table. */
+static int *
+jscan_rows(struct query *query, int *n)
+{
+	struct jscan js;
+	int *rows, *tmp, r, cap;
+
+	cap = 64;
+	rows = malloc(cap * sizeof *rows);
+	if (!rows)
+		return 0;
+
+	*n = 0;
+	jscan_init(&js, query);
+	while ((r = jscan_next(&js)) != -1) {
+		if (*n == cap) {
+			cap *= 2;
+			tmp = realloc(rows, cap * sizeof *rows);
+			if (!tmp) {
+				free(rows);
+				return 0;
+			}
+			rows = tmp;
+		}
+		rows[(*n)++] = r;
+	}
+
+	return rows;
+}
+
+/* Build hash table H of N ROWS of table T by column COL values.
+ * Equal values of different tables are different pointers but have
+ * same hash already computed when interned.  ROWS are owned by H. */
+static int
+jhash_init(struct jhash *h, struct table *t, int col, int *rows, int n)
+{
+	unsigned b;
+	int i;
+
+	h->t = t;
+	h->col = col;
+	h->rows = rows;
+	h->n = n;
+
+	for (h->sz = 16; h->sz < (unsigned)n * 2; h->sz *= 2);
+
+	h->heads = malloc(h->sz * sizeof *h->heads);
+	h->next = malloc((n +1) * sizeof *h->next);
+	if (!h->heads || !h->next)
+		return -1;
+
+	memset(h->heads, -1, h->sz * sizeof *h->heads);
+
+	/* Added backwards so buckets are in table order */
+	for (i=n; i-- > 0;) {
+		b = CELL(t->cells[col][rows[i]])->h & (h->sz-1);
+		h->next[i] = h->heads[b];
+		h->heads[b] = i;
+	}
+
+	return 0;
+}
+
+static void
+jhash_free(struct jhash *h)
+{
+	free(h->rows);
+	free(h->heads);
+	free(h->next);
+}
+
+/* Put joined rows LR of query table and RR of JOIN table as next row
+ * of batch B.  Return 1 when LIMIT is reached. */
+static int
+join_row(struct query *query, struct batch *b, int *coli, int lr, int rr)
+{
+	char *cell;
+	int i;
+
+	if (query->skip) {
+		query->skip--;
+		return 0;
+	}
+
+	for (i=0; i < b->cn; i++) {
+		cell = coli[i] < CMAX ? query->table->cells[coli[i]][lr] :
+		                        query->jt->cells[coli[i] - CMAX][rr];
+		b->vals[i][b->n] = cell;
+		b->lens[i][b->n] = CELL(cell)->len;
+	}
+
+	if (++b->n == BATCH)
+		batch_flush(query, b);
+
+	return query->limit && !(--query->limit);
+}
+
+/* Hash table is built of filtered rows of table with less rows and
+ * other table is scanned probing it, so only smaller side is in memory
+ * and rows are outputted in order of bigger table.  With ORDER on
+ * sorted index defined table is always scanned.  NULL values don't
+ * join. */
+static char *
+join_select(struct query *query, int *coli, int cn)
+{
+	struct table *t, *jt, *pt;
+	struct scan s;
+	struct jscan js;
+	struct jhash h;
+	struct batch b;
+	char *cols[CMAX], *cell, *bc, buf[512];
+	int i, n, r, pr, pcol, *rows, left, end;
+	unsigned hh;
+
+	t = query->table;
+	jt = query->jt;
+
+	for (i=0; i<cn; i++) {
+		pt = coli[i] < CMAX ? t : jt;
+		n = snprintf(buf, sizeof buf, "%s.%s", pt->name,
+		             pt->cols[coli[i] % CMAX]);
+		if (n >= (int)sizeof buf)
+			n = sizeof buf -1;
+		if (!(cols[i] = storez(&query->tmp, buf, n)))
+			return "Failed to store column name";
+	}
+
+	/* Rows read in ORDER come from scanning defined table */
+	left = !query->order && t->rn - t->dn <= jt->rn - jt->dn;
+	rows = left ? matches(query, &n) : jscan_rows(query, &n);
+	if (!rows)
+		return "Failed to allocate memory for matching rows";
+
+	memset(&h, 0, sizeof h);
+	if (jhash_init(&h, left ? t : jt, left ? query->jcol : query->jocol, rows, n) ||
+	    batch_init(&b, cn, cols)) {
+		jhash_free(&h);
+		return "Failed to allocate memory for join";
+	}
+
+	/* Probe side */
+	pt = left ? jt : t;
+	pcol = left ? query->jocol : query->jcol;
+	if (left)
+		jscan_init(&js, query);
+	else
+		scan_init(&s, query);
+
+	end = 0;
+	while (!end && (pr = left ? jscan_next(&js) : scan_next(&s)) != -1) {
+		cell = pt->cells[pcol][pr];
+		if (!strcmp(cell, EMPTY))
+			continue;
+
+		hh = CELL(cell)->h;
+		for (i = h.heads[hh & (h.sz-1)]; !end && i != -1; i = h.next[i]) {
+			r = h.rows[i];
+			bc = h.t->cells[h.col][r];
+			if (CELL(bc)->h != hh || strcmp(bc, cell))
+				continue;
+
+			end = left ? join_row(query, &b, coli, r, pr) :
+			             join_row(query, &b, coli, pr, r);
+		}
+	}
+
+	if (!left)
+		scan_free(&s);
+
+	batch_flush(query, &b);
+	free(b.mem);
+	jhash_free(&h);
+	return 0;
+}
+
+static void
+skey_set(struct query *query, struct skey *k, int r)
+{
+	int col;
+
+	col = abs(query->ord[0]) -1;
+	k->s = query->table->cells[col][r];
+	k->num = number(k->s, &k->d);
+	k->row = r;
+}
+
+/* Compare rows of keys A and B in ORDER, same as compare() does for
+ * each column.  Equal rows are in table order. */
+static int
+skey_cmp(struct query *query, struct skey *a, struct skey *b)
+{
+	char *x, *y;
+	int i, c, col;
+
+	if (a->s == b->s)
+		c = 0;
+	else if (a->num && b->num)
+		c = (a->d > b->d) - (a->d < b->d);
+	else if (a->num != b->num)
+		c = b->num - a->num;
+	else
+		c = strcmp(a->s, b->s);
+
+	if (c)
+		return query->ord[0] < 0 ? -c : c;
+
+	for (i=1; i < query->on; i++) {
+		col = abs(query->ord[i]) -1;
+		x = query->table->cells[col][a->row];
+		y = query->table->cells[col][b->row];
+
+		/* Interned cells are equal only if it's the same cell */
+		if (x != y && (c = compare(x, y)))
+			return query->ord[i] < 0 ? -c : c;
+	}
+
+	return (a->row > b->row) - (a->row < b->row);
+}
+
+/* Move key I of heap K of N keys down so last in order is on top. */
+static void
+heap_down(struct query *query, struct skey *k, int n, int i)
+{
+	struct skey tmp;
+	int c;
+
+	while ((c = 2*i +1) < n) {
+		if (c+1 < n && skey_cmp(query, &k[c+1], &k[c]) > 0)
+			c++;
+
+		if (skey_cmp(query, &k[c], &k[i]) <= 0)
+			break;
+
+		tmp = k[i];
+		k[i] = k[c];
+		k[c] = tmp;
+		i = c;
+	}
+}
+
+/* Bottom up merge sort of N keys K using TMP of same size.  Keys are
+ * sorted in place, not rows, so runs are read sequentially. */
+static void
+skey_sort(struct query *query, struct skey *k, struct skey *tmp, int n)
+{
+	struct skey *src, *dst, *swap;
+	int w, i, a, b, am, bm, o;
+
+	src = k;
+	dst = tmp;
+
+	for (w=1; w<n; w*=2) {
+		for (i=0; i<n; i += 2*w) {
+			a = i;
+			am = i+w < n ? i+w : n;
+			b = am;
+			bm = i + 2*w < n ? i + 2*w : n;
+
+			for (o=i; a < am && b < bm; o++)
+				dst[o] = skey_cmp(query, &src[b], &src[a]) < 0 ?
+				         src[b++] : src[a++];
+
+			while (a < am)
+				dst[o++] = src[a++];
+			while (b < bm)
+				dst[o++] = src[b++];
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != k)
+		memcpy(k, src, n * sizeof *k);
+}
+
+/* With LIMIT only SKIP + LIMIT first rows are kept in heap with last of
+ * them on top, so each row is compared with top and replaces it when
+ * it's before.  Without LIMIT all filtered rows keys are sorted.
+ * Return N sorted keys that have to be freed or null. */
+static struct skey *
+order_rows(struct query *query, int *n)
+{
+	struct scan s;
+	struct skey *k, *tmp, key;
+	int i, r, cap, top;
+
+	top = query->limit ? query->skip + query->limit : 0;
+	cap = top && top < 64 ? top : 64;
+
+	k = malloc(cap * sizeof *k);
+	if (!k)
+		return 0;
+
+	*n = 0;
+	scan_init(&s, query);
+	while ((r = scan_next(&s)) != -1) {
+		skey_set(query, &key, r);
+
+		if (top && *n == top) {
+			if (skey_cmp(query, &key, &k[0]) < 0) {
+				k[0] = key;
+				heap_down(query, k, *n, 0);
+			}
+			continue;
+		}
+
+		if (*n == cap) {
+			cap = top && cap*2 > top ? top : cap*2;
+			tmp = realloc(k, cap * sizeof *k);
+			if (!tmp) {
+				scan_free(&s);
+				free(k);
+				return 0;
+			}
+			k = tmp;
+		}
+
+		k[(*n)++] = key;
+
+		/* Heap is made once it's full */
+		if (top && *n == top)
+			for (i = top/2; i-- > 0;)
+				heap_down(query, k, top, i);
+	}
+	scan_free(&s);
+
+	if (top && *n == top) {	/* Heap sort */
+		for (i = *n -1; i > 0; i--) {
+			key = k[0];
+			k[0] = k[i];
+			k[i] = key;
+			heap_down(query, k, i, 0);
+		}
+	} else {
+		tmp = malloc(*n * sizeof *tmp + 1);
+		if (!tmp) {
+			free(k);
+			return 0;
+		}
+		skey_sort(query, k, tmp, *n);
+		free(tmp);
+	}
+
+	return k;
+}
+
+/* Return word STR or null if STR is a value. */
+static struct word *
+word(char *str)
+{
+	struct word *w;
+
+	for (w = words; w->name; w++)
+		if (!strcmp(w->name, str))
+			return w;
+
+	return 0;
+}
+
+/* Run TABLE word of prepared OP, table found last time is used as
+ * long as no table was added or removed since then. */
+static char *
+table_op(struct query *query, struct op *op)
+{
+	struct boruta_db *db;
+
+	db = query->db;
+	query->tname = pop(query);
+
+	if (op->gen != db->catalog_gen || !query->tname ||
+	    (op->t ? strcmp(op->t->name, query->tname) : 1)) {
+		op->t = table_get(db, query->tname);
+		op->gen = db->catalog_gen;
+	}
+
+	query->table = op->t;
+	return 0;
+}
+
+static char *
+Table(struct query *query)
+{
+	query->tname = pop(query);
+	query->table = table_get(query->db, query->tname);
+	return 0;
+}
+
+static char *
+Info(struct query *query)
+{
+	struct boruta_db *db;
+	int i;
+	char buf0[32], buf1[32], buf2[32], *cols[4], *row[4];
+	struct table *t;
+
+	db = query->db;
+	if (query->tname && !query->table)
+		return msg(query->err, "No table named %s", query->tname);
+
+	cols[0] = "index";
+	row[0] = buf0;
+
+	if (query->table) {	/* List table columns */
+		if (query->table->cn == 0)
+			return msg(query->err, "Table %s has no columns", query->tname);
+
+		cols[1] = "column";
+
+		for (i=0; i < query->table->cn; i++) {
+			snprintf(buf0, sizeof buf0, "%d", i);
+			row[1] = query->table->cols[i];
+			row_out(query, 2, cols, row);
+		}
+	} else {		/* List tables */
+		if (!db->tables)
+			return "No tables";
+
+		cols[1] = "columns";
+		cols[2] = "rows";
+		cols[3] = "table";
+		row[1] = buf1;
+		row[2] = buf2;
+
+		for (i=0, t = db->tables; t; t = t->next, i++) {
+			snprintf(buf0, sizeof buf0, "%d", i);
+			snprintf(buf1, sizeof buf1, "%d", t->cn);
+			snprintf(buf2, sizeof buf2, "%d", t->rn - t->dn);
+			row[3] = t->name;
+			row_out(query, 4, cols, row);
+		}
+	}
+
+	return 0;
+}
+
+static char *
+Load(struct query *query)
+{
+	struct boruta_db *db;
+	char *why, *path, *str;
+	struct stat fs;
+	int fd, empty;
+
+	db = query->db;
+	path = pop(query);
+	if (!path)
+		return "Missing file path";
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return msg(query->err, "Failed to open file '%s'", path);
+
+	if (fstat(fd, &fs) == -1) {
+		close(fd);
+		return "Failed to read file stats";
+	}
+
+	empty = !db->tables;
+
+	if (fs.st_size == 0) {
+		close(fd);
+		if (empty)
+			synced_set(db, path, &fs);
+		return wal_replay(db, path);
+	}
+
+	/* Parser doesn't write to file content and copies cells, so
+	 * file is mapped read only and unmapped right after parsing
+	 * instead of being read to heap. */
+	str = mmap(0, fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (str == MAP_FAILED)
+		return msg(query->err, "Failed to map file '%s'", path);
+
+	posix_madvise(str, fs.st_size, POSIX_MADV_SEQUENTIAL);
+
+	why = parse(db, str, fs.st_size);
+	munmap(str, fs.st_size);
+
+	/* Database is same as file only when loaded to empty one */
+	synced_set(db, !why && empty ? path : 0, &fs);
+	return why ? why : wal_replay(db, path);
+}
+
+static char *
+Stream(struct query *query)
+{
+	struct boruta_db *db;
+	char *why, *path;
+	struct stat fs;
+	int fd, empty;
+
+	db = query->db;
+	path = pop(query);
+	if (!path)
+		return "Missing file path";
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return msg(query->err, "Failed to open file '%s'", path);
+
+	if (fstat(fd, &fs) == -1) {
+		close(fd);
+		return "Failed to read file stats";
+	}
+
+	empty = !db->tables;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	why = stream(db, fd);
+	close(fd);
+
+	synced_set(db, !why && empty ? path : 0, &fs);
+	return why ? why : wal_replay(db, path);
+}
+
+static char *
+Write(struct query *query)
+{
+	struct boruta_db *db;
+	struct out o;
+	struct table *t;
+	char *why, *path;
+
+	db = query->db;
+	if (!db->tables)
+		return "Nothing to write";
+
+	path = pop(query);
+	if (path) {
+		/* Database file has everything from log now */
+		if (db->wal.db && !strcmp(path, db->wal.db))
+			return (why = wal_base(db, path)) ? why : wal_truncate(db);
+
+		return write_atomic(db, path);
+	}
+
+	o.fd = STDOUT_FILENO;
+	o.fail = 0;
+	o.pos = 0;
+	o.n = 0;
+
+	if (!(o.buf = malloc(WCHUNK)))
+		return "Failed to allocate memory for output";
+
+	/* Output bypass stdio, so everything printed before by
+	 * callbacks has to go first. */
+	fflush(stdout);
+
+	for (t = db->tables; t; t = t->next)
+		out_table(&o, t);
+
+	out_flush(&o);
+	free(o.buf);
+
+	return o.fail ? "Failed to write database" : 0;
+}
+
+static char *
+Eq(struct query *query)
+{
+	return cond(query, query->eq, query->jeq);
+}
+
+static char *
+Neq(struct query *query)
+{
+	return cond(query, query->neq, query->jneq);
+}
+
+static char *
+Lt(struct query *query)
+{
+	return cond(query, query->lt, 0);
+}
+
+static char *
+Le(struct query *query)
+{
+	return cond(query, query->le, 0);
+}
+
+static char *
+Gt(struct query *query)
+{
+	return cond(query, query->gt, 0);
+}
+
+static char *
+Ge(struct query *query)
+{
+	return cond(query, query->ge, 0);
+}
+
+static char *
+Between(struct query *query)
+{
+	char *column, *from, *to;
+	int i;
+
+	if (!query->table)
+		return "Undefined table";
+
+	column = pop(query);
+	to = pop(query);
+	from = pop(query);
+
+	if (!column)
+		return "Missing column";
+
+	if (!from)
+		return msg(query->err, "Missing range for column %s", column);
+
+	i = column_indexof(query->table, column);
+	if (i == -1)
+		return msg(query->err, "Column %s don't exist", column);
+
+	query->ge[i] = from;
+	query->le[i] = to;
+
+	return 0;
+}
+
+static char *
+Order(struct query *query)
+{
+	char *column;
+	int i, j, desc, ord[CMAX];
+
+	if (!query->table)
+		return "Undefined table";
+
+	for (j=CMAX; (column = pop(query));) {
+		if (j == 0)
+			return "Too many ORDER columns";
+
+		/* Column can be named with leading "-" too */
+		desc = 0;
+		i = column_indexof(query->table, column);
+		if (i == -1 && *column == '-') {
+			desc = 1;
+			i = column_indexof(query->table, column +1);
+		}
+
+		if (i == -1)
+			return msg(query->err, "Column %s don't exist", column + desc);
+
+		ord[--j] = desc ? -(i+1) : i+1;
+	}
+
+	query->on = CMAX - j;
+	if (query->on == 0)
+		return "Missing column";
+
+	for (i=0; i < query->on; i++)
+		query->ord[i] = ord[j++];
+
+	/* Single ascending column is in order of its sorted index */
+	i = query->ord[0];
+	query->order = query->on == 1 && i > 0 && query->table->tree[i-1] ? i : 0;
+
+	return 0;
+}
+
+static char *
+Skip(struct query *query)
+{
+	char *str;
+
+	str = pop(query);
+	query->skip = str ? atoi(str) : 0;
+
+	return 0;
+}
+
+static char *
+Limit(struct query *query)
+{
+	char *str;
+
+	str = pop(query);
+	query->limit = str ? atoi(str) : 0;
+
+	return 0;
+}
+
+static char *
+Select(struct query *query)
+{
+	struct scan s;
+	struct batch b;
+	struct skey *k;
+	char *why, *cell, *cols[CMAX];
+	int i, r, coli[CMAX], cn, ki, kn;
+
+	if (!query->table)
+		return "Undefined table";
+
+	if ((why = columns(query, coli, &cn)))
+		return why;
+
+	if (cn == 0)
+		return "Nothing to select";
+
+	if (query->jt)
+		return query->cursor ? "Cursor can't read joined tables" :
+		       query->on && !query->order ? "Joined rows can't be ordered" :
+		       join_select(query, coli, cn);
+
+	if (query->cursor && query->on && !query->order)
+		return "Cursor can read ORDER rows only of sorted index";
+
+	if (query->cursor)
+		return cursor_select(query->cursor, coli, cn);
+
+	for (i=0; i<cn; i++)
+		cols[i] = query->table->cols[coli[i]];
+
+	if (batch_init(&b, cn, cols))
+		return "Failed to allocate memory for rows";
+
+	/* Rows in order of ORDER keys or of scan */
+	k = 0;
+	if (query->on && !query->order && !(k = order_rows(query, &kn))) {
+		free(b.mem);
+		return "Failed to allocate memory for ORDER";
+	}
+
+	if (!k)
+		scan_init(&s, query);
+
+	for (ki=0; (r = k ? (ki < kn ? k[ki++].row : -1) : scan_next(&s)) != -1;) {
+		if (query->skip) {
+			query->skip--;
+			continue;
+		}
+
+		for (i=0; i<cn; i++) {
+			cell = query->table->cells[coli[i]][r];
+			b.vals[i][b.n] = cell;
+			b.lens[i][b.n] = CELL(cell)->len;
+		}
+
+		if (++b.n == BATCH)
+			batch_flush(query, &b);
+
+		if (query->limit && !(--query->limit))
+			break;
+	}
+
+	batch_flush(query, &b);
+	if (!k)
+		scan_free(&s);
+	free(b.mem);
+	free(k);
+	return 0;
+}
+
+static char *
+Count(struct query *query)
+{
+	return aggregate(query, ACOUNT);
+}
+
+static char *
+Sum(struct query *query)
+{
+	return aggregate(query, ASUM);
+}
+
+static char *
+Min(struct query *query)
+{
+	return aggregate(query, AMIN);
+}
+
+static char *
+Max(struct query *query)
+{
+	return aggregate(query, AMAX);
+}
+
+static char *
+Avg(struct query *query)
+{
+	return aggregate(query, AAVG);
+}
+
+/* Groups are output in order of their first row, after whole table is
+ * scanned, so SKIP and LIMIT count groups. */
+static char *
+Group(struct query *query)
+{
+	struct scan s;
+	struct batch b;
+	struct groups g = {0};
+	struct group *gr;
+	char *why, *cols[CMAX], *key[CMAX];
+	int i, r, gi[CMAX], gn;
+
+	if (!query->table)
+		return "Undefined table";
+
+	if (!query->an)
+		return "Nothing to aggregate";
+
+	if (query->jt)
+		return "Joined tables can't be grouped";
+
+	if ((why = columns(query, gi, &gn)))
+		return why;
+
+	if (gn + query->an > CMAX)
+		return "Too many columns";
+
+	for (i=0; i<gn; i++)
+		cols[i] = query->table->cols[gi[i]];
+
+	for (i=0; i < query->an; i++)
+		if (!(cols[gn+i] = agg_name(query, i)))
+			return "Failed to store column name";
+
+	if (batch_init(&b, gn + query->an, cols))
+		return "Failed to allocate memory for rows";
+
+	scan_init(&s, query);
+	while (!why && (r = scan_next(&s)) != -1) {
+		for (i=0; i<gn; i++)
+			key[i] = query->table->cells[gi[i]][r];
+
+		if ((gr = group_get(query, &g, key, gn)))
+			group_add(query, gr, r);
+		else
+			why = "Failed to allocate memory for group";
+	}
+	scan_free(&s);
+
+	/* Without group columns there is always one row */
+	if (!why && !gn && !g.first && !group_get(query, &g, key, 0))
+		why = "Failed to allocate memory for group";
+
+	for (gr = g.first; !why && gr; gr = gr->order) {
+		if (query->skip) {
+			query->skip--;
+			continue;
+		}
+
+		if ((why = group_row(query, &b, gr, gn)))
+			break;
+
+		if (++b.n == BATCH)
+			batch_flush(query, &b);
+
+		if (query->limit && !(--query->limit))
+			break;
+	}
+
+	if (!why)
+		batch_flush(query, &b);
+
+	free(b.mem);
+	free(g.buckets);
+	return why;
+}
+
+static char *
+Join(struct query *query)
+{
+	char *tname, *col, *ocol;
+
+	if (!query->table)
+		return "Undefined table";
+
+	ocol = pop(query);
+	tname = pop(query);
+	col = pop(query);
+
+	if (!col)
+		return "Missing JOIN column, table and its column";
+
+	query->jt = table_get(query->db, tname);
+	if (!query->jt)
+		return msg(query->err, "No table named %s", tname);
+
+	if (query->jt == query->table)
+		return "Table can't be joined with itself";
+
+	query->jcol = column_indexof(query->table, col);
+	if (query->jcol == -1)
+		return msg(query->err, "Column %s don't exist", col);
+
+	query->jocol = column_indexof(query->jt, ocol);
+	if (query->jocol == -1)
+		return msg(query->err, "Column %s don't exist", ocol);
+
+	return 0;
+}
+
+static char *
+Create(struct query *query)
+{
+	char *cell, *cells[CMAX] = {0};
+	int i, j;
+
+	if (!query->tname)
+		return "Missing table name";
+
+	if (query->table)
+		return "Table already exists";
+
+	query->table = table_new(query->db, query->tname, strlen(query->tname));
+	if (!query->table)
+		return "Failed to create new table";
+
+	query->table->dirty = 1;
+
+	for (i=0; i < CMAX-1 && (cell = pop(query)); i++)
+		if (!(cells[i] = store(&query->table->arena, cell, -1)))
+			return "Failed to store column name";
+
+	/* NOTE(irek): Decrement to preserve columns order. */
+	for (j=0; i--; j++) {
+		cell = cells[i];
+		query->table->cn++;
+		query->table->cols[j] = cell;
+		query->table->width[j] = utf8len(cell);
+	}
+
+	return wal_create(query->table);
+}
+
+static char *
+Insert(struct query *query)
+{
+	struct table *t;
+	char *column, *value, *cells[CMAX]={0};
+	int i, r;
+
+	t = query->table;
+	if (!t)
+		return "Undefined table";
+
+	while (1) {
+		column = pop(query);
+		value = pop(query);
+
+		if (!column)
+			break;	/* End, nothing more on stack */
+
+		if (!value)
+			return msg(query->err, "Missing value for column %s", column);
+
+		i = column_indexof(t, column);
+		if (i == -1)
+			return msg(query->err, "Column %s don't exist", column);
+
+		cells[i] = value;
+	}
+
+	r = row_new(t);
+	if (r == -1)
+		return msg(query->err, "Failed to create row for table %s", t->name);
+
+	t->dirty = 1;
+	t->gen = ++query->db->gen;
+
+	for (i=0; i < t->cn; i++) {
+		value = cells[i] ? cells[i] : EMPTY;
+		t->cells[i][r] = intern(t, i, value, strlen(value));
+		if (t->cells[i][r])
+			continue;
+
+		t->rn--;
+		while (i--)
+			unref(t, i, t->cells[i][r]);
+		return msg(query->err, "Failed to store cell of table %s", t->name);
+	}
+
+	for (i=0; i < t->cn; i++) {
+		if (t->index[i] && index_add(t->index[i], t->cells[i][r], r))
+			return msg(query->err, "Failed to index column %s", t->cols[i]);
+
+		if (t->tree[i] && tree_add(t->tree[i], t->cells[i][r], r))
+			return msg(query->err, "Failed to index column %s", t->cols[i]);
+	}
+
+	return wal_insert(t, r);
+}
+
+static char *
+Set(struct query *query)
+{
+	struct table *t;
+	char *why, *column, *value, *new[CMAX]={0};
+	int i, n, *rows;
+
+	t = query->table;
+	if (!t)
+		return "Undefined table";
+
+	if (query->jt)
+		return "Joined tables can't be changed";
+
+	while (1) {
+		column = pop(query);
+		value = pop(query);
 
 		if (!column)
 			break;	/* End, nothing more on stack */
 
 		if (!value)
-			return msg("Missing value for column %s", column);
+			return msg(query->err, "Missing value for column %s", column);
 
 		i = column_indexof(t, column);
 		if (i == -1)
-			return msg("Column %s don't exist", column);
+			return msg(query->err, "Column %s don't exist", column);
 
 		new[i] = value;
 	}
 
-	for (r = t->rows; r; r = r->next) {
-		if (filter(query, r))
-			continue;
+	rows = matches(query, &n);
+	if (!rows)
+		return "Failed to allocate memory for matching rows";
 
-		for (i=0; i < t->cn; i++)
-			if (new[i])
-				r->cells[i] = store(new[i], -1);
-	}
+	why = table_set(t, new, rows, n);
+	if (!why && n)
+		why = wal_set(t, new, rows, n);
 
-	return 0;
+	free(rows);
+	return why;
 }
 
 static char *
 Del(struct query *query)
 {
 	struct table *t;
-	struct row *r;
+	char *why;
+	int n, *rows;
 
 	t = query->table;
 	if (!t)
 		return "Undefined table";
 
-	for (r = t->rows; r; r = r->next) {
-		if (filter(query, r))
-			continue;
+	if (query->jt)
+		return "Joined tables can't be changed";
 
-		row_del(t, r);
-	}
+	rows = matches(query, &n);
+	if (!rows)
+		return "Failed to allocate memory for matching rows";
 
-	return 0;
+	why = table_del(t, rows, n);
+	if (!why && n)
+		why = wal_del(t, rows, n);
+
+	free(rows);
+	return why;
 }
 
 static char *
 Drop(struct query *query)
 {
+	struct boruta_db *db;
+
+	db = query->db;
 	if (query->tname) {
 		if (!query->table)
-			return msg("No table named %s", query->tname);
+			return msg(query->err, "No table named %s", query->tname);
 
 		table_drop(query->table);
+		db->dropped = 1;
 	} else {
-		while (tables)
-			table_drop(tables);
+		while (db->tables)
+			table_drop(db->tables);
+		synced_set(db, 0, 0);
+	}
+
+	return wal_drop(db, query->tname);
+}
+
+static char *
+Index(struct query *query)
+{
+	char *column;
+	int i;
+
+	if (!query->table)
+		return "Undefined table";
+
+	while ((column = pop(query))) {
+		i = column_indexof(query->table, column);
+		if (i == -1)
+			return msg(query->err, "Column %s don't exist", column);
+
+		if (query->table->index[i])
+			continue;
+
+		query->table->index[i] = index_new(query->table, i);
+		if (!query->table->index[i])
+			return msg(query->err, "Failed to index column %s", column);
+	}
+
+	return 0;
+}
+
+static char *
+Sorted(struct query *query)
+{
+	char *column;
+	int i;
+
+	if (!query->table)
+		return "Undefined table";
+
+	while ((column = pop(query))) {
+		i = column_indexof(query->table, column);
+		if (i == -1)
+			return msg(query->err, "Column %s don't exist", column);
+
+		if (query->table->tree[i])
+			continue;
+
+		query->table->tree[i] = tree_new(query->table, i);
+		if (!query->table->tree[i])
+			return msg(query->err, "Failed to index column %s", column);
 	}
 
 	return 0;
@@ -847,69 +4943,511 @@ static char *
 Now(struct query *query)
 {
 	time_t now;
-	struct tm *tm;
+	struct tm tm;
 	char buf[64], *str;
 	unsigned sz;
 
 	now = time(0);
-	tm = localtime(&now);
-	sz = strftime(buf, sizeof buf, "%Y-%M-%D", tm);
-
-	/* TODO(irek): This is not great.  Value like Today might be
-	 * created only for purpose of filtering SELECT output, which
-	 * means that lifetime of this store memory is most likely
-	 * only for time of running single command, and not enrite
-	 * program like most of the values.  The main storage is more
-	 * suited for storing table cell values. */
-	str = store(buf, sz);
+	localtime_r(&now, &tm);
+	sz = strftime(buf, sizeof buf, "%Y-%M-%D", &tm);
+
+	/* Value lives only for the time of query, INSERT and SET
+	 * copy it to table memory if needed. */
+	str = store(&query->tmp, buf, sz +1);
+	if (!str)
+		return "Failed to store date";
+
 	push(query, str);
 	return 0;
 }
 
+static char *
+Wal(struct query *query)
+{
+	struct boruta_db *db;
+	char *why, *path, p[PATH_MAX];
+
+	db = query->db;
+	wal_close(db);
+
+	path = pop(query);
+	if (!path)
+		return 0;
+
+	if (!(db->wal.db = malloc(strlen(path) +1)))
+		return "Failed to allocate memory for file path";
+
+	strcpy(db->wal.db, path);
+	snprintf(p, sizeof p, "%s.wal", path);
+
+	/* Old log is emptied only after database file has its data */
+	db->wal.fd = open(p, O_WRONLY|O_CREAT|O_APPEND, 0666);
+	if (db->wal.fd == -1) {
+		wal_close(db);
+		return msg(query->err, "Failed to open log '%s'", p);
+	}
+
+	/* Log starts from database file having all current data */
+	if ((why = wal_base(db, path)) || (why = wal_truncate(db)))
+		wal_close(db);
+
+	return why;
+}
+
+static char *
+Sync(struct query *query)
+{
+	struct boruta_db *db;
+	char *str;
+
+	db = query->db;
+	str = pop(query);
+	if (!str)
+		return "Missing number of records";
+
+	db->sync_n = atoi(str);
+	if (db->sync_n < 0)
+		db->sync_n = 0;
+
+	db->wal.pending = 0;
+	if (db->wal.fd != -1 && fdatasync(db->wal.fd))
+		return "Failed to sync log";
+
+	return inplace_flush(db);
+}
+
+static char *
+Checkpoint(struct query *query)
+{
+	struct boruta_db *db;
+	char *why;
+
+	db = query->db;
+	if (db->wal.fd == -1)
+		return "Log is not enabled";
+
+	if ((why = wal_base(db, db->wal.db)))
+		return why;
+
+	return wal_truncate(db);
+}
+
+static char *
+Inplace(struct query *query)
+{
+	struct boruta_db *db;
+	char *why, *path;
+
+	db = query->db;
+	inplace_close(db);
+
+	path = pop(query);
+	if (!path)
+		return 0;
+
+	/* Mapped file has to be same as database */
+	if ((why = write_atomic(db, path)))
+		return why;
+
+	return inplace_open(db, path);
+}
+
+static void
+db_init(struct boruta_db *db)
+{
+	memset(db, 0, sizeof *db);
+	db->wal.fd = -1;
+	db->inplace.fd = -1;
+	db->sync_n = 1;
+	pthread_rwlock_init(&db->lock, 0);
+}
+
+static void
+db0_init(void)
+{
+	db_init(&db0);
+}
+
+/* Queries that only read run at the same time holding shared lock,
+ * query with any word that modifies database waits for exclusive one.
+ * Callback is called with lock held so it can't run modifying query on
+ * the same instance. */
+static void
+query_lock(struct boruta_db *db, int write)
+{
+	if (write)
+		pthread_rwlock_wrlock(&db->lock);
+	else
+		pthread_rwlock_rdlock(&db->lock);
+}
+
+/* Return DB or instance of boruta() when DB is null. */
+static struct boruta_db *
+instance(struct boruta_db *db)
+{
+	if (db)
+		return db;
+
+	pthread_once(&db0_once, db0_init);
+	return &db0;
+}
+
+/* Run query FMT formatted with AP to CMD buffer of SZ size on
+ * instance and with callbacks defined in Q.  Return error that was
+ * given to callback. */
+static char *
+query_run(struct query *q, char *cmd, size_t sz, char *fmt, va_list ap)
+{
+	char *why, *cp;
+	char *str[CMDMAX];	/* Word takes at least 1 byte */
+	struct word *w[CMDMAX];
+	int i, n, write;
+	unsigned len;
+
+	pthread_once(&simd_once, simd_pick);
+
+	why = 0;
+	len = vsnprintf(cmd, sz, fmt, ap);
+
+	if (len >= sz)
+		why = msg(q->err, "Command max length %d exceeded", sz);
+
+	/* Lock is picked before running first word */
+	for (n = write = 0, cp = cmd; !why && (str[n] = next(&cp)); n++)
+		if ((w[n] = word(str[n])) && w[n]->write)
+			write = 1;
+
+	if (!why) {
+		query_lock(q->db, write);
+
+		/* Word pushes at most one value more than it pops */
+		for (i=0; !why && i<n; i++)
+			if (q->si == SMAX)
+				why = "Too many values on stack";
+			else if (w[i])
+				why = (*w[i]->fn)(q);
+			else
+				push(q, str[i]);
+
+		/* Other query can write instance error after unlock */
+		if (why == q->db->err)
+			why = msg(q->err, "%s", why);
+
+		pthread_rwlock_unlock(&q->db->lock);
+	}
+
+	if (why)
+		query_fail(q, why);
+
+	/* Cursor values live until cursor is closed */
+	if (!q->cursor)
+		arena_free(&q->tmp);
+
+	return why;
+}
+
 void
 boruta(boruta_cb_t cb, void *ctx, char *fmt, ...)
 {
 	struct query q = {0};
-	char *why, *str, cmd[4096], *cp;
+	char cmd[CMDMAX];
 	va_list ap;
-	unsigned n;
 
-	why = 0;
 	q.cb = cb;
 	q.ctx = ctx;
+	q.db = instance(0);
 
 	va_start(ap, fmt);
-	n = vsnprintf(cmd, sizeof cmd, fmt, ap);
+	query_run(&q, cmd, sizeof cmd, fmt, ap);
 	va_end(ap);
+}
 
-	if (n >= sizeof cmd)
-		why = msg("Command max length %d exceeded", sizeof cmd);
+boruta_db *
+boruta_open(void)
+{
+	struct boruta_db *db;
 
-	cp = cmd;
-	while (1) {
-		if (why) {
-			(*cb)(ctx, why, 0, 0, 0);
-			break;
+	db = malloc(sizeof *db);
+	if (db)
+		db_init(db);
+
+	return db;
+}
+
+void
+boruta_query(boruta_db *db, boruta_cb_t cb, void *ctx, char *fmt, ...)
+{
+	struct query q = {0};
+	char cmd[CMDMAX];
+	va_list ap;
+
+	q.cb = cb;
+	q.ctx = ctx;
+	q.db = instance(db);
+
+	va_start(ap, fmt);
+	query_run(&q, cmd, sizeof cmd, fmt, ap);
+	va_end(ap);
+}
+
+void
+boruta_query_batch(boruta_db *db, boruta_batch_cb_t cb, void *ctx, char *fmt, ...)
+{
+	struct query q = {0};
+	char cmd[CMDMAX];
+	va_list ap;
+
+	q.batch = cb;
+	q.ctx = ctx;
+	q.db = instance(db);
+
+	va_start(ap, fmt);
+	query_run(&q, cmd, sizeof cmd, fmt, ap);
+	va_end(ap);
+}
+
+void
+boruta_close(boruta_db *db)
+{
+	if (!db)
+		return;
+
+	inplace_close(db);
+	wal_close(db);
+
+	while (db->tables)
+		table_drop(db->tables);
+
+	free(db->catalog);
+	free(db->synced);
+	pthread_rwlock_destroy(&db->lock);
+	free(db);
+}
+
+boruta_cursor *
+boruta_cursor_open(boruta_db *db, boruta_cb_t cb, void *ctx, char *fmt, ...)
+{
+	struct boruta_cursor *c;
+	char *why;
+	va_list ap;
+
+	c = calloc(1, sizeof *c);
+	if (!c)
+		return 0;
+
+	c->q.cb = cb;
+	c->q.ctx = ctx;
+	c->q.db = instance(db);
+	c->q.cursor = c;
+
+	va_start(ap, fmt);
+	why = query_run(&c->q, c->cmd, sizeof c->cmd, fmt, ap);
+	va_end(ap);
+
+	if (!why && !c->t)
+		query_fail(&c->q, "Cursor query has no SELECT");
+
+	if (why || !c->t) {
+		boruta_cursor_close(c);
+		return 0;
+	}
+
+	return c;
+}
+
+/* Lock is not held between rows so cursor doesn't stop writers.
+ * Instead every row checks that cursor table wasn't changed or dropped
+ * since SELECT.  Table found again by name could be new one at same
+ * address, but then its GEN is newer. */
+int
+boruta_cursor_next(boruta_cursor *c, char ***cols, char ***row)
+{
+	struct boruta_db *db;
+	char *why;
+	int r;
+
+	db = c->q.db;
+	why = 0;
+	r = -1;
+
+	pthread_rwlock_rdlock(&db->lock);
+
+	if (!c->done && db->catalog_gen != c->catalog_gen) {
+		if (table_get(db, c->tname) != c->t)
+			why = "Table changed since cursor was opened";
+		c->catalog_gen = db->catalog_gen;
+	}
+
+	if (!why && !c->done && c->t->gen != c->gen)
+		why = "Table changed since cursor was opened";
+
+	while (!why && !c->done && (r = scan_next(&c->s)) != -1 && c->q.skip)
+		c->q.skip--;
+
+	if (r != -1) {
+		why = cursor_row(c, r);
+		if (c->q.limit && !(--c->q.limit))
+			c->done = 1;
+	} else
+		c->done = 1;
+
+	pthread_rwlock_unlock(&db->lock);
+
+	if (why) {
+		query_fail(&c->q, why);
+		return -1;
+	}
+
+	if (r == -1)
+		return 0;
+
+	if (cols)
+		*cols = c->cols;
+	if (row)
+		*row = c->row;
+
+	return c->cn;
+}
+
+void
+boruta_cursor_close(boruta_cursor *c)
+{
+	if (!c)
+		return;
+
+	scan_free(&c->s);
+	arena_free(&c->q.tmp);
+	free(c->buf);
+	free(c);
+}
+
+boruta_stmt *
+boruta_prepare(boruta_db *db, char *query)
+{
+	boruta_stmt *st;
+	struct op *op;
+	struct word *w;
+	size_t len;
+	char *str, *cp;
+
+	len = strlen(query);
+
+	st = malloc(sizeof *st + len +1);
+	if (!st)
+		return 0;
+
+	/* Query has at most one word for every byte */
+	st->ops = malloc((len +1) * sizeof *op);
+	if (!st->ops) {
+		free(st);
+		return 0;
+	}
+
+	memcpy(st->buf, query, len +1);
+	st->db = instance(db);
+	st->n = st->pn = st->write = 0;
+
+	for (cp = st->buf; (str = next(&cp));) {
+		op = &st->ops[st->n++];
+		memset(op, 0, sizeof *op);
+		op->str = str;
+
+		/* Quoted "?" is a value */
+		if (!strcmp(str, "?") && (str == st->buf ||
+		    (str[-1] != '"' && str[-1] != '\''))) {
+			op->str = 0;
+			op->param = st->pn++;
+		} else if ((w = word(str))) {
+			op->fn = w->fn;
+			st->write |= w->write;
 		}
+	}
+
+	st->params = calloc(st->pn +1, sizeof *st->params);
+	if (!st->params) {
+		free(st->ops);
+		free(st);
+		return 0;
+	}
+
+	return st;
+}
+
+int
+boruta_bind(boruta_stmt *st, int i, char *value)
+{
+	if (i < 1 || i > st->pn)
+		return -1;
+
+	st->params[i-1] = value;
+	return 0;
+}
+
+/* Run prepared query ST with callbacks defined in Q. */
+static void
+stmt_run(boruta_stmt *st, struct query *q)
+{
+	struct op *op;
+	char *why;
+
+	pthread_once(&simd_once, simd_pick);
+
+	why = 0;
+	q->db = st->db;
+
+	query_lock(q->db, st->write);
+
+	for (op = st->ops; !why && op < st->ops + st->n; op++)
+		if (q->si == SMAX)
+			why = "Too many values on stack";
+		else if (op->fn == Table)
+			why = table_op(q, op);
+		else if (op->fn)
+			why = (*op->fn)(q);
+		else if (op->str)
+			push(q, op->str);
+		else if (st->params[op->param])
+			push(q, st->params[op->param]);
+		else
+			why = msg(q->err, "Parameter %d is not bound", op->param +1);
+
+	if (why == q->db->err)
+		why = msg(q->err, "%s", why);
+
+	pthread_rwlock_unlock(&q->db->lock);
+
+	if (why)
+		query_fail(q, why);
+
+	arena_free(&q->tmp);
+}
+
+void
+boruta_exec(boruta_stmt *st, boruta_cb_t cb, void *ctx)
+{
+	struct query q = {0};
+
+	q.cb = cb;
+	q.ctx = ctx;
+	stmt_run(st, &q);
+}
+
+void
+boruta_exec_batch(boruta_stmt *st, boruta_batch_cb_t cb, void *ctx)
+{
+	struct query q = {0};
+
+	q.batch = cb;
+	q.ctx = ctx;
+	stmt_run(st, &q);
+}
 
-		str = next(&cp);
-		if (!str) break;
-		else if (!strcmp(str,"TABLE"))	why = Table(&q);
-		else if (!strcmp(str,"INFO"))	why = Info(&q);
-		else if (!strcmp(str,"LOAD"))	why = Load(&q);
-		else if (!strcmp(str,"WRITE"))	why = Write(&q);
-		else if (!strcmp(str,"EQ"))	why = Eq(&q);
-		else if (!strcmp(str,"NEQ"))	why = Neq(&q);
-		else if (!strcmp(str,"SKIP"))	why = Skip(&q);
-		else if (!strcmp(str,"LIMIT"))	why = Limit(&q);
-		else if (!strcmp(str,"SELECT"))	why = Select(&q);
-		else if (!strcmp(str,"CREATE"))	why = Create(&q);
-		else if (!strcmp(str,"INSERT"))	why = Insert(&q);
-		else if (!strcmp(str,"SET"))	why = Set(&q);
-		else if (!strcmp(str,"DEL"))	why = Del(&q);
-		else if (!strcmp(str,"DROP"))	why = Drop(&q);
-		else if (!strcmp(str,"NULL"))	why = Null(&q);
-		else if (!strcmp(str,"NOW"))	why = Now(&q);
-		else push(&q, str);
+void
+boruta_finalize(boruta_stmt *st)
+{
+	if (st) {
+		free(st->params);
+		free(st->ops);
+		free(st);
 	}
 }
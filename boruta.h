@@ -1,8 +1,13 @@
 /* Boruta v1.0
 
-Currently there is no concept of "instance" when working with Boruta
-lib.  There is single global state and memory management is only about
-allocating more for new data.  You have been warned.
+Database is an instance that owns its tables, allocator and error
+message.  boruta() works on default instance, others are created with
+boruta_open(), see API.
+
+Each table owns its memory that is released on DROP.  Memory of cells
+replaced by SET or deleted by DEL is reclaimed once it gets more than
+half of table memory.  Values created by query, like NOW, live only
+for the time of that query.
 
 
 LANGUAGE:
@@ -17,23 +22,53 @@ space in single string.
 WORDS:
 
 TABLE Defines table name taking one element from stack.  Existing
-table is used by INFO, EQ, NEQ, SELECT, INSERT, SET, DEL and DROP.
+table is used by INFO, EQ, NEQ, LT, LE, GT, GE, BETWEEN, ORDER, SELECT,
+INSERT, SET, DEL, DROP, INDEX and SORTED.
 Non existing table name is used by CREATE.
 
 INFO Prints column names for defined table.  For undefined table
 prints list of all tables with number of columns and rows in each.
 
 LOAD Load file using one element from stack as file path.  Loaded file
-is parsed adding tables internal database memory.
+is parsed adding tables internal database memory.  Big files are split
+on empty lines between tables and parsed by as many threads as there
+are processors.  Then mutations logged in file with same path and
+".wal" suffix are applied, see WAL.
+
+STREAM Same as LOAD but file is read and parsed in chunks by single
+thread.  Only parsed tables and one chunk are kept in memory, so it
+can load files bigger than available memory.
 
 WRITE Takes one element from stack as file path.  Write database to
-that file or to standard output if path is undefined.
+that file or to standard output if path is undefined.  File is written
+next to path and renamed over it after flushing to disk, so crash never
+leaves it half written.  Nothing is written if database didn't change
+since it was loaded from or written to same path.  Otherwise blocks of
+unchanged tables are copied from that file as they are and only changed
+tables are formatted again.
 
 EQ Defines "equal" filter conditions for "value column" pairs on stack
-for defined table.  Used by SELECT, SET and DEL.
+for defined table.  Used by SELECT, SET and DEL.  Rows are looked up
+with index when filtered column has one.  Otherwise rows of big table
+are filtered in parallel by ranges, still in table order.
 
 NEQ Same as EQ but it is "not equal" filter.
 
+LT, LE, GT, GE Same as EQ but it is "less than", "less or equal",
+"greater than" and "greater or equal" filter.  Numbers are compared
+by value and before any other strings that are compared lexically.
+Rows are looked up with sorted index when filtered column has one.
+Then rows are outputted in order of that column values.
+
+BETWEEN Defines GE and LE filters taking "from to column" from stack.
+
+ORDER Makes SELECT output rows in order of columns taken from stack,
+first pushed column being compared first.  Column name with "-" prefix
+is in descending order.  Values are compared same as by LT and GT.
+Single ascending column with sorted index is read in order of index.
+Otherwise filtered rows are sorted and with LIMIT only SKIP and LIMIT
+first rows are kept in memory.
+
 SKIP Defines how many rows should be skipped on SELECT by taking one
 number from stack.
 
@@ -43,6 +78,28 @@ number from stack.
 SELECT Selects rows from defined table with specified column names
 taken from stack.  For "*" column name all table columns are taken.
 
+COUNT Defines "count" aggregate of rows for GROUP.
+
+SUM, MIN, MAX, AVG Define "sum(column)", "min(column)", "max(column)"
+and "avg(column)" aggregates of column taken from stack for GROUP.
+NULL values are skipped, SUM and AVG also skip values that are not
+numbers.  MIN and MAX compare values same as LT and GT.
+
+GROUP Same as SELECT but outputs single row for each group of rows
+that have equal values in columns taken from stack.  Row has group
+columns followed by aggregates values.  Without columns on stack all
+filtered rows are one group.  SKIP and LIMIT count groups.
+
+JOIN Takes "column table column" from stack and makes SELECT output
+rows of defined table joined with rows of given table where values of
+both columns are equal.  Columns of both tables can be selected with
+"table.column" names, "*" selects all.  Output column names have
+table prefix.  EQ and NEQ after JOIN can filter columns of joined
+table too.  Table with less rows is held in memory as hash table and
+rows come in order of the other one.  ORDER works only on defined
+table column with sorted index, then joined table is held in memory.
+NULL values are never equal.
+
 CREATE Adds new table with name defined by TABLE and column names
 taken from stack.
 
@@ -56,6 +113,30 @@ DEL Delete rows from defined table for matchin EQ and NEQ filters.
 
 DROP Deletes defined table or all tables if stack is empty.
 
+INDEX Builds hash index for defined table on columns taken from stack.
+Index is kept up to date by INSERT, SET and DEL and used by EQ.
+
+SORTED Same as INDEX but builds sorted index used by EQ, LT, LE, GT,
+GE, BETWEEN and ORDER.
+
+WAL Takes one element from stack as file path.  Database is written
+to that file and from now on CREATE, INSERT, SET, DEL and DROP append
+short records to log file with ".wal" suffix instead of requiring
+whole database WRITE.  WRITE to that path truncates log.  Without path
+log is closed.  Log is replayed by LOAD of that same file only, not of
+its copy, and records already written to file are skipped.
+
+SYNC Takes number from stack and makes WAL and INPLACE flush changes
+to disk after every that many records or rows, 1 by default.  With 0
+it is left to system.
+
+CHECKPOINT Writes database to WAL file and truncates log.
+
+INPLACE Takes one element from stack as file path.  Database is written
+to that file and file is mapped to memory.  From now on SET with value
+that fits in padded cell of unchanged table overwrites cell in file
+directly, so table doesn't need WRITE.  Without path file is unmapped.
+
 NULL Puts empty ("---") value on stack.
 
 NOW Puts current date in "%Y-%M-%D" format on stack.
@@ -66,16 +147,77 @@ API:
 Callback boruta_cb_t is called each time boruta() outputs row data
 when running INFO or SELECT words or error occured.  CTX points at
 context defined in boruta().  On error WHY will be a string with
-message, other args should be ignored.  Else CN will define number
-of columns and rows in COLS and ROWS string arrays.
+message valid until callback returns, other args should be ignored.
+Else CN will define number of columns and rows in COLS and ROWS
+string arrays.
 
 To run database query call boruta() with optional CB callback and
 optional CTX context of user data.  FMT is a format string like in
 printf() being a valid query.
 
+All boruta() calls share one database.  Independent database instance
+is created with boruta_open() and queried with boruta_query() taking
+same arguments as boruta(), null DB being boruta() database.  Each
+instance has own tables, synced file, WAL and INPLACE map.  Instance
+is freed with boruta_close() that also closes its WAL and INPLACE
+files.
+
+Instance can be queried from many threads.  Queries that only read,
+like SELECT or INFO, run at the same time while query with any word
+that modifies database waits for them and runs alone.  Callback is
+called with instance locked so it must not run modifying query on
+same instance.
+
+Query that is run many times can be prepared once with
+boruta_prepare() for DB instance or for boruta() database when DB is
+null.  Each unquoted "?" in QUERY is a parameter that is
+given value with boruta_bind() by its number starting from 1.  Value
+is not copied and has to be valid until boruta_exec() that runs
+prepared query same as boruta() would.  Parameters stay bound between
+runs.  Prepared query is freed with boruta_finalize().  Single
+prepared query can't be run by many threads at the same time.
+
+Callback boruta_batch_cb_t given to boruta_query_batch() or
+boruta_exec_batch() gets up to 256 rows at once.  N is number of rows
+and VALS[c][i] is value of column C in row I with LENS[c][i] length
+in bytes.  Arrays are valid only until callback returns.  INFO rows
+and errors are given to it same way with N being 1 or 0.
+
+Rows of SELECT can be read one at a time with cursor instead of
+callback.  boruta_cursor_open() runs query like boruta_query() but
+query SELECT only prepares rows, CB gets errors and rows of other
+words.  Null is returned on error or when query has no SELECT.  Each
+boruta_cursor_next() call puts next row in ROW and column names in
+COLS and returns number of columns, 0 at the end and -1 on error
+given to CB.  Values are copied and valid until next call.  Instance
+is not locked between calls so cursor table can be changed by other
+query and then cursor ends with error.  SKIP and LIMIT are respected.
+Cursor is freed with boruta_cursor_close() at any moment.
+
 */
 
 typedef void (*boruta_cb_t)(void *ctx, char *why,
                             int cn, char **cols, char **row);
 
+typedef void (*boruta_batch_cb_t)(void *ctx, char *why, int cn, char **cols,
+                                  int n, char ***vals, int **lens);
+
+typedef struct boruta_db boruta_db;
+typedef struct boruta_stmt boruta_stmt;
+typedef struct boruta_cursor boruta_cursor;
+
 void boruta(boruta_cb_t cb, void *ctx, char *fmt, ...);
+boruta_db *boruta_open(void);
+void boruta_query(boruta_db *db, boruta_cb_t cb, void *ctx, char *fmt, ...);
+void boruta_query_batch(boruta_db *db, boruta_batch_cb_t cb, void *ctx,
+                        char *fmt, ...);
+void boruta_close(boruta_db *db);
+boruta_stmt *boruta_prepare(boruta_db *db, char *query);
+int boruta_bind(boruta_stmt *stmt, int i, char *value);
+void boruta_exec(boruta_stmt *stmt, boruta_cb_t cb, void *ctx);
+void boruta_exec_batch(boruta_stmt *stmt, boruta_batch_cb_t cb, void *ctx);
+void boruta_finalize(boruta_stmt *stmt);
+boruta_cursor *boruta_cursor_open(boruta_db *db, boruta_cb_t cb, void *ctx,
+                                  char *fmt, ...);
+int boruta_cursor_next(boruta_cursor *cur, char ***cols, char ***row);
+void boruta_cursor_close(boruta_cursor *cur);
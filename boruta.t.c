@@ -4,6 +4,7 @@
 struct ctx {
 	int count;
 	char *why;
+	char buf[512];	/* WHY copy, valid only in callback */
 };
 
 static void
@@ -16,7 +17,7 @@ cb(void *_ctx, char *why, int cn, char **cols, char **row)
 	(void)row;
 
 	ctx->count++;
-	ctx->why = (char*)why;
+	ctx->why = why ? strncpy(ctx->buf, why, sizeof ctx->buf -1) : 0;
 }
 
 TEST("Create tables")
@@ -83,3 +84,1279 @@ TEST("Insert data")
 	OK(ctx.count == 3);
 	OK(ctx.why == 0);
 }
+
+TEST("Empty words")
+{
+	struct ctx ctx = {0};
+	char buf[CMDMAX];
+
+	/* Every new line ends a word, even empty one */
+	memset(buf, '\n', sizeof buf -1);
+	buf[sizeof buf -1] = 0;
+	boruta(cb, &ctx, "%s", buf);
+	OK(ctx.count == 1);
+	OK(ctx.why && !strcmp(ctx.why, "Too many values on stack"));
+
+	boruta(cb, &ctx, "\n\n\n");
+	OK(ctx.count == 1);
+}
+
+TEST("Many tables")
+{
+	struct ctx ctx = {0};
+	int i;
+
+	for (i=0; i<1000; i++)
+		boruta(cb, &ctx, "t%d TABLE a b CREATE", i);
+	OK(ctx.count == 0);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "INFO");
+	OK(ctx.count == 1003);
+	OK(ctx.why == 0);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "t500 TABLE INFO");
+	OK(ctx.count == 2);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "t500 TABLE DROP");
+	boruta(cb, &ctx, "t500 TABLE INFO");
+	SAME(ctx.why, "No table named t500", -1);
+
+	memset(&ctx, 0, sizeof ctx);
+	for (i=0; i<1000; i++)
+		if (i != 500)
+			boruta(cb, &ctx, "t%d TABLE DROP", i);
+	OK(ctx.count == 0);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "INFO");
+	OK(ctx.count == 3);
+	OK(ctx.why == 0);
+}
+
+TEST("Index")
+{
+	struct ctx ctx = {0};
+
+	boruta(cb, &ctx, "idx TABLE id name CREATE");
+	boruta(cb, &ctx, "idx TABLE 1 id a name INSERT");
+	boruta(cb, &ctx, "idx TABLE 2 id b name INSERT");
+	boruta(cb, &ctx, "idx TABLE 3 id a name INSERT");
+	boruta(cb, &ctx, "idx TABLE name INDEX");
+	OK(ctx.count == 0);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "idx TABLE a name EQ * SELECT");
+	OK(ctx.count == 2);
+	OK(ctx.why == 0);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "idx TABLE 4 id a name INSERT");
+	boruta(cb, &ctx, "idx TABLE 1 id EQ c name SET");
+	boruta(cb, &ctx, "idx TABLE a name EQ * SELECT");
+	OK(ctx.count == 2);
+	boruta(cb, &ctx, "idx TABLE c name EQ * SELECT");
+	OK(ctx.count == 3);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "idx TABLE a name EQ DEL");
+	boruta(cb, &ctx, "idx TABLE a name EQ * SELECT");
+	OK(ctx.count == 0);
+	boruta(cb, &ctx, "idx TABLE * SELECT");
+	OK(ctx.count == 2);
+	boruta(cb, &ctx, "idx TABLE 2 id x name EQ * SELECT");
+	OK(ctx.count == 2);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "idx TABLE DROP");
+}
+
+static void
+cb_first(void *_ctx, char *why, int cn, char **cols, char **row)
+{
+	struct ctx *ctx = _ctx;
+
+	(void)cn;
+	(void)cols;
+
+	if (ctx->count++ == 0)
+		ctx->why = why ? why : row[0];
+}
+
+TEST("Sorted index")
+{
+	struct ctx ctx = {0};
+	int i;
+
+	boruta(cb, &ctx, "srt TABLE id date CREATE");
+	for (i=20; i>0; i--)
+		boruta(cb, &ctx, "srt TABLE %d id 2024-01-%02d date INSERT", i, i);
+	boruta(cb, &ctx, "srt TABLE id date SORTED");
+	OK(ctx.count == 0);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "srt TABLE 5 id LT * SELECT");
+	OK(ctx.count == 4);
+	OK(ctx.why == 0);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "srt TABLE 5 id LE 15 id GT * SELECT");
+	OK(ctx.count == 0);
+
+	boruta(cb, &ctx, "srt TABLE 2024-01-05 2024-01-10 date BETWEEN * SELECT");
+	OK(ctx.count == 6);
+	OK(ctx.why == 0);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb_first, &ctx, "srt TABLE id ORDER 3 LIMIT id SELECT");
+	OK(ctx.count == 3);
+	SAME(ctx.why, "1", -1);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb_first, &ctx, "srt TABLE 9 id GE id ORDER id SELECT");
+	OK(ctx.count == 12);
+	SAME(ctx.why, "9", -1);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "srt TABLE 3 id LE DEL");
+	boruta(cb, &ctx, "srt TABLE 5 id EQ 100 id SET");
+	boruta(cb_first, &ctx, "srt TABLE 10 id GT id ORDER id SELECT");
+	OK(ctx.count == 11);
+	SAME(ctx.why, "11", -1);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "srt TABLE date ORDER * SELECT");
+	OK(ctx.count == 17);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "srt TABLE DROP");
+}
+
+TEST("Table memory")
+{
+	struct ctx ctx = {0};
+	struct arena a = {0};
+	struct table *t;
+	boruta_stmt *st;
+	char name[CHUNK +2];	/* Odd size */
+	int i;
+
+	boruta(cb, &ctx, "mem TABLE id val CREATE");
+	for (i=0; i<100; i++)
+		boruta(cb, &ctx, "mem TABLE %d id x val INSERT", i);
+
+	for (i=0; i<10000; i++)
+		boruta(cb, &ctx, "mem TABLE 7 id EQ value-%d val SET", i);
+	OK(ctx.count == 0);
+	OK(ctx.why == 0);
+
+	t = table_get(&db0, "mem");
+	OK(t->arena.used < 2*CHUNK);
+
+	boruta(cb, &ctx, "mem TABLE value-9999 val EQ * SELECT");
+	OK(ctx.count == 1);
+
+	boruta(cb, &ctx, "mem TABLE DROP");
+
+	/* First chunk bigger than CHUNK with odd size */
+	OK(store(&a, 0, CHUNK +1) != 0);
+	OK(store(&a, "abc", 4) != 0);
+	OK(a.head->off <= a.head->sz);
+	arena_free(&a);
+
+	/* Table name alone is bigger than CHUNK */
+	memset(name, 'n', sizeof name -1);
+	name[sizeof name -1] = 0;
+	st = boruta_prepare(0, "? TABLE a b CREATE");
+	boruta_bind(st, 1, name);
+	boruta_exec(st, cb, &ctx);
+	boruta_finalize(st);
+	OK(ctx.why == 0);
+	OK(table_get(&db0, name) != 0);
+	st = boruta_prepare(0, "? TABLE DROP");
+	boruta_bind(st, 1, name);
+	boruta_exec(st, cb, &ctx);
+	boruta_finalize(st);
+	OK(table_get(&db0, name) == 0);
+}
+
+TEST("Interned cells")
+{
+	struct ctx ctx = {0};
+	struct table *t;
+
+	boruta(cb, &ctx, "int TABLE id flag CREATE");
+	boruta(cb, &ctx, "int TABLE 1 id on flag INSERT");
+	boruta(cb, &ctx, "int TABLE 2 id off flag INSERT");
+	boruta(cb, &ctx, "int TABLE 3 id on flag INSERT");
+	boruta(cb, &ctx, "int TABLE 4 id INSERT");
+
+	t = table_get(&db0, "int");
+	OK(t->cells[1][0] == t->cells[1][2]);
+	OK(t->dict[1].n == 3);
+
+	boruta(cb, &ctx, "int TABLE 2 id EQ on flag SET");
+	OK(t->dict[1].n == 2);
+	boruta(cb, &ctx, "int TABLE on flag EQ * SELECT");
+	OK(ctx.count == 3);
+	boruta(cb, &ctx, "int TABLE NULL flag EQ * SELECT");
+	OK(ctx.count == 4);
+	boruta(cb, &ctx, "int TABLE nope flag EQ * SELECT");
+	OK(ctx.count == 4);
+	boruta(cb, &ctx, "int TABLE nope flag NEQ * SELECT");
+	OK(ctx.count == 8);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "int TABLE DROP");
+}
+
+TEST("Write and load")
+{
+	struct ctx ctx = {0};
+
+	boruta(cb, &ctx, "wl TABLE id name CREATE");
+	boruta(cb, &ctx, "wl TABLE 1 id 'Zażółć gęślą' name INSERT");
+	boruta(cb, &ctx, "wl TABLE 2 id INSERT");
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "DROP");
+	boruta(cb, &ctx, "boruta.t.db LOAD");
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "wl TABLE 'Zażółć gęślą' name EQ * SELECT");
+	OK(ctx.count == 1);
+	boruta(cb, &ctx, "wl TABLE NULL name EQ 2 id EQ * SELECT");
+	OK(ctx.count == 2);
+	boruta(cb, &ctx, "INFO");
+	OK(ctx.count == 6);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "boruta.t.db LOAD");
+	SAME(ctx.why, "Table aaa already exist", -1);
+
+	boruta(cb, &ctx, "wl TABLE DROP");
+	remove("boruta.t.db");
+}
+
+TEST("Write padding")
+{
+	struct ctx ctx = {0};
+	char buf[4096];
+	FILE *fp;
+	size_t n;
+
+	boruta(cb, &ctx, "wp TABLE id name CREATE");
+	boruta(cb, &ctx, "wp TABLE 1 id 'Zażółć' name INSERT");
+	boruta(cb, &ctx, "wp TABLE 2 id INSERT");
+	boruta(cb, &ctx, "wp TABLE 2 id EQ 'Gęślą jaźń' name SET");
+	boruta(cb, &ctx, "wp TABLE 1 id EQ Ala name SET");
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(ctx.why == 0);
+
+	fp = fopen("boruta.t.db", "r");
+	n = fread(buf, 1, sizeof buf - 1, fp);
+	buf[n] = 0;
+	fclose(fp);
+
+	SAME(strstr(buf, "wp\n"),
+	     "wp\n"
+	     "id  name        \n"
+	     "1   Ala         \n"
+	     "2   Gęślą jaźń  \n"
+	     "\n", -1);
+
+	boruta(cb, &ctx, "wp TABLE DROP");
+	remove("boruta.t.db");
+}
+
+TEST("Atomic write")
+{
+	struct ctx ctx = {0};
+	struct stat a, b;
+
+	boruta(cb, &ctx, "aw TABLE id CREATE");
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(ctx.why == 0);
+	OK(stat("boruta.t.db", &a) == 0);
+
+	/* Clean database is not written again */
+	boruta(cb, &ctx, "aw TABLE 1 id EQ * SELECT");
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(stat("boruta.t.db", &b) == 0);
+	OK(a.st_ino == b.st_ino);
+
+	/* New file replaces old one */
+	boruta(cb, &ctx, "aw TABLE 1 id INSERT");
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(ctx.why == 0);
+	OK(stat("boruta.t.db", &b) == 0);
+	OK(a.st_ino != b.st_ino);
+	OK(b.st_size > a.st_size);
+
+	a = b;
+	boruta(cb, &ctx, "aw TABLE 2 id EQ DEL");
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(stat("boruta.t.db", &b) == 0);
+	OK(a.st_ino == b.st_ino);
+
+	boruta(cb, &ctx, "aw TABLE DROP");
+	remove("boruta.t.db");
+}
+
+TEST("Load in parallel")
+{
+	struct ctx ctx = {0};
+	FILE *fp;
+	int i, j;
+
+	fp = fopen("boruta.t.db", "w");
+	for (i=0; i<300; i++) {
+		fprintf(fp, "big%d\nid  name  email\n", i);
+		for (j=0; j<300; j++)
+			fprintf(fp, "%d  name%d  user%d@old.camp\n", j, j%7, j);
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+
+	boruta(cb, &ctx, "boruta.t.db LOAD");
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "big299 TABLE name3 name EQ * SELECT");
+	OK(ctx.count == 43);
+	boruta(cb, &ctx, "big0 TABLE 299 id EQ * SELECT");
+	OK(ctx.count == 44);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "INFO");
+	OK(ctx.count == 303);
+
+	for (i=0; i<300; i++)
+		boruta(cb, &ctx, "big%d TABLE DROP", i);
+	remove("boruta.t.db");
+}
+
+TEST("Stream")
+{
+	struct ctx ctx = {0};
+	FILE *fp;
+	int i, j;
+
+	fp = fopen("boruta.t.db", "w");
+	for (i=0; i<100; i++) {
+		fprintf(fp, "st%d\nid  name  email\n", i);
+		for (j=0; j<300; j++)
+			fprintf(fp, "%d  name%d  user%d@old.camp\n", j, j%7, j);
+		fprintf(fp, "\n");
+	}
+	/* Line longer than read chunk without new line at the end */
+	fprintf(fp, "long\nid  text\n1  ");
+	for (i=0; i < SCHUNK*3/2; i++)
+		fputc('a' + i%26, fp);
+	fclose(fp);
+
+	boruta(cb, &ctx, "boruta.t.db STREAM");
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "st99 TABLE name3 name EQ * SELECT");
+	OK(ctx.count == 43);
+	boruta(cb, &ctx, "st0 TABLE 299 id EQ * SELECT");
+	OK(ctx.count == 44);
+	OK(table_get(&db0, "long")->rn == 1);
+	OK(strlen(table_get(&db0, "long")->cells[1][0]) == SCHUNK*3/2);
+
+	boruta(cb, &ctx, "boruta.t.db STREAM");
+	SAME(ctx.why, "Table st0 already exist", -1);
+
+	for (i=0; i<100; i++)
+		boruta(cb, &ctx, "st%d TABLE DROP", i);
+	boruta(cb, &ctx, "long TABLE DROP");
+	remove("boruta.t.db");
+}
+
+TEST("Write ahead log")
+{
+	struct ctx ctx = {0};
+	struct stat fs, db;
+	FILE *fp;
+
+	/* Keep tables of other tests aside */
+	boruta(cb, &ctx, "boruta.t.all WRITE DROP");
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "kept TABLE id CREATE");
+	boruta(cb, &ctx, "boruta.t.db WAL");
+	OK(ctx.why == 0);
+	OK(stat("boruta.t.db", &db) == 0);
+	boruta(cb, &ctx, "0 SYNC");
+
+	boruta(cb, &ctx, "log TABLE id name CREATE");
+	boruta(cb, &ctx, "log TABLE 1 id Ala name INSERT");
+	boruta(cb, &ctx, "log TABLE 2 id Ola name INSERT");
+	boruta(cb, &ctx, "log TABLE 3 id 'Zażółć gęślą' name INSERT");
+	boruta(cb, &ctx, "log TABLE 2 id EQ Ela name SET");
+	boruta(cb, &ctx, "log TABLE 1 id EQ DEL");
+	boruta(cb, &ctx, "kept TABLE DROP");
+	OK(ctx.why == 0);
+
+	/* Database file is not touched, only log grows */
+	OK(stat("boruta.t.db", &fs) == 0);
+	OK(fs.st_ino == db.st_ino);
+	OK(fs.st_size == db.st_size);
+	OK(stat("boruta.t.db.wal", &fs) == 0);
+	OK(fs.st_size > 0);
+
+	/* Half written record is ignored */
+	fp = fopen("boruta.t.db.wal", "a");
+	fwrite("\x20\0\0\0\x01\x02", 1, 6, fp);
+	fclose(fp);
+
+	boruta(cb, &ctx, "WAL DROP boruta.t.db LOAD");
+	OK(ctx.why == 0);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "INFO");
+	OK(ctx.count == 1);
+	boruta(cb, &ctx, "log TABLE * SELECT");
+	OK(ctx.count == 3);
+	boruta(cb, &ctx, "log TABLE Ela name EQ 2 id EQ * SELECT");
+	OK(ctx.count == 4);
+
+	boruta(cb, &ctx, "boruta.t.db WAL log TABLE 4 id INSERT CHECKPOINT");
+	OK(ctx.why == 0);
+	OK(stat("boruta.t.db.wal", &fs) == 0);
+	OK(fs.st_size == 8 + 1 + 4 + 4*4);	/* Mark of database file */
+
+	boruta(cb, &ctx, "WAL DROP boruta.t.db LOAD");
+	boruta(cb, &ctx, "log TABLE * SELECT");
+	OK(ctx.count == 7);
+
+	boruta(cb, &ctx, "DROP boruta.t.all LOAD");
+	OK(ctx.why == 0);
+	remove("boruta.t.all");
+	remove("boruta.t.db");
+	remove("boruta.t.db.wal");
+}
+
+TEST("Corrupted log")
+{
+	struct ctx ctx = {0};
+	boruta_db *db;
+	int i;
+
+	db = boruta_open();
+	boruta_query(db, cb, &ctx, "boruta.t.db WAL");
+	OK(ctx.why == 0);
+
+	/* Record with more columns than table can have */
+	wal_begin(db, 'C', "big");
+	wal_u32(db, SMAX * 2);
+	for (i=0; i < SMAX * 2; i++)
+		wal_str(db, "c");
+	OK(wal_end(db) == 0);
+
+	boruta_query(db, cb, &ctx, "WAL boruta.t.db LOAD");
+	SAME(ctx.why, "Corrupted log", -1);
+
+	boruta_close(db);
+	remove("boruta.t.db");
+	remove("boruta.t.db.wal");
+}
+
+TEST("Log after checkpoint")
+{
+	struct ctx ctx = {0};
+	boruta_db *db;
+	char buf[4096];
+	size_t n;
+	FILE *fp;
+
+	db = boruta_open();
+	boruta_query(db, cb, &ctx, "boruta.t.db WAL");
+	boruta_query(db, cb, &ctx, "ck TABLE id CREATE 1 id INSERT 2 id INSERT");
+	OK(ctx.why == 0);
+
+	fp = fopen("boruta.t.db.wal", "r");
+	n = fread(buf, 1, sizeof buf, fp);
+	fclose(fp);
+	OK(n > 0);
+
+	/* Crash before log truncate leaves records of database file */
+	boruta_query(db, cb, &ctx, "CHECKPOINT");
+	OK(ctx.why == 0);
+	fp = fopen("boruta.t.db.wal", "w");
+	fwrite(buf, 1, n, fp);
+	fclose(fp);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta_query(db, cb, &ctx, "WAL DROP boruta.t.db LOAD");
+	boruta_query(db, cb, &ctx, "ck TABLE * SELECT");
+	OK(ctx.count == 2);
+	OK(ctx.why == 0);
+
+	/* Records after checkpoint are replayed */
+	boruta_query(db, cb, &ctx, "boruta.t.db WAL ck TABLE 3 id INSERT");
+	boruta_query(db, cb, &ctx, "WAL DROP boruta.t.db LOAD");
+	boruta_query(db, cb, &ctx, "ck TABLE * SELECT");
+	OK(ctx.count == 5);
+	OK(ctx.why == 0);
+
+	boruta_close(db);
+	remove("boruta.t.db");
+	remove("boruta.t.db.wal");
+}
+
+TEST("Incremental write")
+{
+	struct ctx ctx = {0};
+	char buf[4096];
+	FILE *fp;
+	size_t n;
+
+	boruta(cb, &ctx, "boruta.t.all WRITE DROP");
+	OK(ctx.why == 0);
+
+	/* Odd formatting shows which blocks were copied as they are,
+	 * last table has no empty line after it */
+	fp = fopen("boruta.t.db", "w");
+	fputs("one\nid     name\n1  a\n\n\n"
+	      "two\nid  name\n2      b\n   \n"
+	      "three\nid\n3\n", fp);
+	fclose(fp);
+
+	boruta(cb, &ctx, "boruta.t.db LOAD");
+	boruta(cb, &ctx, "two TABLE 2 id EQ c name SET");
+	boruta(cb, &ctx, "four TABLE x CREATE");
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(ctx.why == 0);
+
+	fp = fopen("boruta.t.db", "r");
+	n = fread(buf, 1, sizeof buf - 1, fp);
+	buf[n] = 0;
+	fclose(fp);
+
+	SAME(buf, "one\nid     name\n1  a\n\n\n"
+	     "two\nid  name  \n2   c     \n\n"
+	     "three\nid  \n3   \n\n"
+	     "four\nx  \n\n", -1);
+
+	/* Written file is source of next write */
+	boruta(cb, &ctx, "one TABLE DROP boruta.t.db WRITE");
+	fp = fopen("boruta.t.db", "r");
+	n = fread(buf, 1, sizeof buf - 1, fp);
+	buf[n] = 0;
+	fclose(fp);
+
+	SAME(buf, "two\nid  name  \n2   c     \n\n"
+	     "three\nid  \n3   \n\n"
+	     "four\nx  \n\n", -1);
+
+	boruta(cb, &ctx, "DROP boruta.t.all LOAD");
+	OK(ctx.why == 0);
+	remove("boruta.t.all");
+	remove("boruta.t.db");
+}
+
+TEST("Set in place")
+{
+	struct ctx ctx = {0};
+	struct stat a, b;
+	char buf[4096];
+	FILE *fp;
+	size_t n;
+
+	boruta(cb, &ctx, "boruta.t.all WRITE DROP");
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "ip TABLE id status CREATE");
+	boruta(cb, &ctx, "ip TABLE 1 id waiting status INSERT");
+	boruta(cb, &ctx, "ip TABLE 2 id ok status INSERT");
+	boruta(cb, &ctx, "boruta.t.db INPLACE");
+	OK(ctx.why == 0);
+	OK(stat("boruta.t.db", &a) == 0);
+
+	boruta(cb, &ctx, "ip TABLE 1 id EQ done status SET");
+	boruta(cb, &ctx, "ip TABLE 2 id EQ Żół status SET");
+	OK(ctx.why == 0);
+	OK(table_get(&db0, "ip")->dirty == 0);
+
+	fp = fopen("boruta.t.db", "r");
+	n = fread(buf, 1, sizeof buf - 1, fp);
+	buf[n] = 0;
+	fclose(fp);
+
+	SAME(buf, "ip\n"
+	     "id  status   \n"
+	     "1   done     \n"
+	     "2   Żół   \n\n", -1);
+
+	/* Same file is still synced, clean WRITE does nothing */
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(stat("boruta.t.db", &b) == 0);
+	OK(a.st_ino == b.st_ino);
+
+	/* Value wider than column needs full write, last one too */
+	boruta(cb, &ctx, "ip TABLE 2 id EQ finished status SET");
+	OK(table_get(&db0, "ip")->dirty == 1);
+	boruta(cb, &ctx, "boruta.t.db WRITE");
+	OK(stat("boruta.t.db", &b) == 0);
+	OK(a.st_ino != b.st_ino);
+
+	/* Mapping follows written file */
+	boruta(cb, &ctx, "ip TABLE 1 id EQ new status SET");
+	OK(table_get(&db0, "ip")->dirty == 0);
+	boruta(cb, &ctx, "INPLACE DROP boruta.t.db LOAD");
+	OK(ctx.why == 0);
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "ip TABLE new status EQ * SELECT");
+	OK(ctx.count == 1);
+	boruta(cb, &ctx, "ip TABLE finished status EQ * SELECT");
+	OK(ctx.count == 2);
+
+	boruta(cb, &ctx, "DROP boruta.t.all LOAD");
+	OK(ctx.why == 0);
+	remove("boruta.t.all");
+	remove("boruta.t.db");
+}
+
+TEST("Column width")
+{
+	struct ctx ctx = {0};
+	struct table *t;
+
+	boruta(cb, &ctx, "cw TABLE id name CREATE");
+	boruta(cb, &ctx, "cw TABLE 1 id Ala name INSERT");
+	boruta(cb, &ctx, "cw TABLE 2 id 'Zażółć gęślą jaźń' name INSERT");
+	boruta(cb, &ctx, "cw TABLE 3 id 'Zażółć gęślą jaźń' name INSERT");
+	OK(ctx.why == 0);
+
+	t = table_get(&db0, "cw");
+	OK(t->width[1] == 17);
+
+	boruta(cb, &ctx, "cw TABLE 2 id EQ Ola name SET");
+	OK(t->width[1] == 17);
+	boruta(cb, &ctx, "cw TABLE 3 id EQ Kasia name SET");
+	OK(t->width[1] == 5);
+	boruta(cb, &ctx, "cw TABLE 3 id EQ DEL");
+	OK(t->width[1] == 4);
+	OK(t->width[0] == 2);
+
+	boruta(cb, &ctx, "cw TABLE DROP");
+}
+
+TEST("Delete rows")
+{
+	struct ctx ctx = {0};
+	struct table *t;
+	int i;
+
+	boruta(cb, &ctx, "dr TABLE id odd CREATE");
+	for (i=0; i<100; i++)
+		boruta(cb, &ctx, "dr TABLE %d id %d odd INSERT", i, i%2);
+	boruta(cb, &ctx, "dr TABLE odd INDEX id SORTED");
+	OK(ctx.why == 0);
+
+	t = table_get(&db0, "dr");
+
+	/* Few deleted rows wait for compaction */
+	for (i=0; i<10; i++)
+		boruta(cb, &ctx, "dr TABLE %d id EQ DEL", i*2);
+	OK(t->rn == 100);
+	OK(t->dn == 10);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "dr TABLE * SELECT");
+	OK(ctx.count == 90);
+	boruta(cb, &ctx, "dr TABLE 0 odd EQ * SELECT");
+	OK(ctx.count == 90 + 40);
+	boruta(cb, &ctx, "dr TABLE 10 id LT * SELECT");
+	OK(ctx.count == 130 + 5);
+
+	/* Index of inserted row after deleted ones */
+	boruta(cb, &ctx, "dr TABLE 100 id 0 odd INSERT");
+	boruta(cb, &ctx, "dr TABLE 100 id EQ * SELECT");
+	OK(ctx.count == 136);
+
+	/* Deleting all even rows compacts table */
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "dr TABLE 0 odd EQ DEL");
+	OK(t->dn == 0);
+	OK(t->rn == 50);
+	boruta(cb, &ctx, "dr TABLE 1 odd EQ 49 id GT * SELECT");
+	OK(ctx.count == 25);
+	boruta(cb, &ctx, "dr TABLE 99 id EQ 98 id NEQ * SELECT");
+	OK(ctx.count == 26);
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "dr TABLE DROP");
+}
+
+TEST("Log after delete")
+{
+	struct ctx ctx = {0};
+	int i;
+
+	boruta(cb, &ctx, "boruta.t.all WRITE DROP");
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "ld TABLE id v CREATE");
+	for (i=0; i<10; i++)
+		boruta(cb, &ctx, "ld TABLE %d id x v INSERT", i);
+
+	/* Log row numbers match file without deleted row */
+	boruta(cb, &ctx, "ld TABLE 0 id EQ DEL");
+	boruta(cb, &ctx, "boruta.t.db WAL");
+	boruta(cb, &ctx, "ld TABLE 5 id EQ y v SET");
+	OK(ctx.why == 0);
+
+	boruta(cb, &ctx, "WAL DROP boruta.t.db LOAD");
+	OK(ctx.why == 0);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "ld TABLE y v EQ 5 id EQ * SELECT");
+	OK(ctx.count == 1);
+	boruta(cb, &ctx, "ld TABLE y v EQ * SELECT");
+	OK(ctx.count == 2);
+	boruta(cb, &ctx, "ld TABLE * SELECT");
+	OK(ctx.count == 11);
+
+	boruta(cb, &ctx, "DROP boruta.t.all LOAD");
+	OK(ctx.why == 0);
+	remove("boruta.t.all");
+	remove("boruta.t.db");
+	remove("boruta.t.db.wal");
+}
+
+TEST("Prepared query")
+{
+	struct ctx ctx = {0};
+	boruta_stmt *ins, *sel;
+	char id[16], buf[1024];
+	int i;
+
+	ins = boruta_prepare(0, "ps TABLE ? id ? name '?' mark INSERT");
+	sel = boruta_prepare(0, "? TABLE ? name EQ * SELECT");
+	OK(ins && sel);
+
+	/* Unbound parameter */
+	boruta_exec(ins, cb, &ctx);
+	SAME(ctx.why, "Parameter 1 is not bound", -1);
+	OK(boruta_bind(ins, 3, "x") == -1);
+	memset(&ctx, 0, sizeof ctx);
+
+	boruta(cb, &ctx, "ps TABLE id name mark CREATE");
+	boruta_bind(ins, 2, "Ala");
+	for (i=0; i<10; i++) {
+		snprintf(id, sizeof id, "%d", i);
+		boruta_bind(ins, 1, id);
+		boruta_exec(ins, cb, &ctx);
+	}
+	boruta_bind(ins, 2, "Ola");
+	boruta_exec(ins, cb, &ctx);
+	OK(ctx.why == 0);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta_bind(sel, 1, "ps");
+	boruta_bind(sel, 2, "Ala");
+	boruta_exec(sel, cb, &ctx);
+	OK(ctx.count == 10);
+	boruta(cb, &ctx, "ps TABLE ? mark EQ * SELECT");
+	OK(ctx.count == 21);
+
+	/* Table is found again after it was dropped and created */
+	boruta(cb, &ctx, "ps TABLE DROP ps TABLE name CREATE");
+	boruta(cb, &ctx, "ps TABLE Ala name INSERT");
+	memset(&ctx, 0, sizeof ctx);
+	boruta_exec(sel, cb, &ctx);
+	OK(ctx.count == 1);
+	OK(ctx.why == 0);
+
+	boruta_bind(sel, 1, "none");
+	boruta_exec(sel, cb, &ctx);
+	SAME(ctx.why, "Undefined table", -1);
+
+	boruta_finalize(ins);
+	boruta_finalize(sel);
+	boruta(cb, &ctx, "ps TABLE DROP");
+
+	/* Every new line is a word */
+	memset(buf, '\n', sizeof buf -1);
+	buf[sizeof buf -1] = 0;
+	ins = boruta_prepare(0, buf);
+	OK(ins != 0);
+	boruta_exec(ins, cb, &ctx);
+	SAME(ctx.why, "Too many values on stack", -1);
+	boruta_finalize(ins);
+}
+
+TEST("Instances")
+{
+	struct ctx ctx = {0};
+	boruta_db *a, *b;
+	boruta_stmt *sel;
+
+	a = boruta_open();
+	b = boruta_open();
+	OK(a && b);
+
+	boruta_query(a, cb, &ctx, "in TABLE id CREATE 1 id INSERT");
+	boruta_query(b, cb, &ctx, "in TABLE id name CREATE");
+	boruta_query(b, cb, &ctx, "in TABLE 2 id x name INSERT 3 id y name INSERT");
+	OK(ctx.why == 0);
+	OK(table_get(&db0, "in") == 0);
+
+	boruta_query(a, cb, &ctx, "in TABLE * SELECT");
+	OK(ctx.count == 1);
+	boruta_query(b, cb, &ctx, "in TABLE * SELECT");
+	OK(ctx.count == 3);
+
+	/* Prepared query runs on its instance */
+	memset(&ctx, 0, sizeof ctx);
+	sel = boruta_prepare(b, "in TABLE ? name EQ * SELECT");
+	boruta_bind(sel, 1, "y");
+	boruta_exec(sel, cb, &ctx);
+	OK(ctx.count == 1);
+	boruta_finalize(sel);
+
+	/* Error of one instance doesn't touch other */
+	boruta_query(a, cb, &ctx, "in TABLE x none EQ");
+	SAME(ctx.why, "Column none don't exist", -1);
+	boruta_query(b, cb, &ctx, "xx TABLE DROP");
+	SAME(ctx.why, "No table named xx", -1);
+
+	boruta_close(a);
+	boruta_close(b);
+}
+
+struct ids {
+	int n, id[8];
+};
+
+static void
+ids_cb(void *_ctx, char *why, int cn, char **cols, char **row)
+{
+	struct ids *ctx = _ctx;
+
+	(void)cols;
+
+	if (!why && cn && ctx->n < 8)
+		ctx->id[ctx->n] = atoi(row[0]);
+	ctx->n++;
+}
+
+TEST("Parallel scan")
+{
+	struct ctx ctx = {0};
+	struct ids ids = {0};
+	boruta_stmt *ins;
+	char id[16], mod[16];
+	int i, n;
+
+	n = MORSEL*3 + 5;
+	boruta(cb, &ctx, "ms TABLE id mod CREATE");
+	ins = boruta_prepare(0, "ms TABLE ? id ? mod INSERT");
+	boruta_bind(ins, 1, id);
+	boruta_bind(ins, 2, mod);
+	for (i=0; i<n; i++) {
+		snprintf(id, sizeof id, "%d", i);
+		snprintf(mod, sizeof mod, "%d", i % 7);
+		boruta_exec(ins, cb, &ctx);
+	}
+	boruta_finalize(ins);
+	OK(ctx.why == 0);
+
+	/* Rows come in table order with SKIP past first morsel */
+	boruta(ids_cb, &ids, "ms TABLE 3 mod EQ 2400 SKIP 3 LIMIT id SELECT");
+	OK(ids.n == 3);
+	OK(ids.id[0] == 3 + 7*2400);
+	OK(ids.id[1] == 3 + 7*2401);
+	OK(ids.id[2] == 3 + 7*2402);
+
+	boruta(cb, &ctx, "ms TABLE 3 mod EQ id SELECT");
+	OK(ctx.count == (n-3 +6) / 7);
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "ms TABLE 3 mod EQ x mod SET 0 mod EQ DEL");
+	boruta(cb, &ctx, "ms TABLE x mod EQ id SELECT");
+	OK(ctx.count == (n-3 +6) / 7);
+	boruta(cb, &ctx, "ms TABLE 0 mod EQ id SELECT");
+	OK(ctx.count == (n-3 +6) / 7);
+	OK(ctx.why == 0);
+
+	/* Left are mods 1, 2, x, 4, 5, 6 */
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "ms TABLE 1 mod NEQ id SELECT");
+	for (i=0; i<n; i++)
+		ctx.count -= i%7 > 1;
+	OK(ctx.count == 0);
+
+	boruta(cb, &ctx, "ms TABLE DROP");
+}
+
+static void *
+reader(void *arg)
+{
+	struct ctx ctx = {0};
+	int i;
+
+	for (i=0; i<200; i++)
+		boruta_query(arg, cb, &ctx, "cr TABLE 0 id NEQ * SELECT");
+
+	return ctx.why;
+}
+
+TEST("Concurrent readers")
+{
+	struct ctx ctx = {0};
+	boruta_db *db;
+	pthread_t th[4];
+	void *why;
+	int i;
+
+	db = boruta_open();
+	boruta_query(db, cb, &ctx, "cr TABLE id CREATE 0 id INSERT");
+
+	for (i=0; i<4; i++)
+		OK(pthread_create(&th[i], 0, reader, db) == 0);
+
+	for (i=1; i<=200; i++)
+		boruta_query(db, cb, &ctx, "cr TABLE %d id INSERT", i);
+
+	for (i=0; i<4; i++) {
+		pthread_join(th[i], &why);
+		OK(why == 0);
+	}
+
+	boruta_query(db, cb, &ctx, "cr TABLE 0 id NEQ * SELECT");
+	OK(ctx.count == 200);
+	OK(ctx.why == 0);
+	boruta_close(db);
+}
+
+struct rows {
+	int batches, n, bad;
+	char *why, buf[512];
+};
+
+static void
+rows_cb(void *_ctx, char *why, int cn, char **cols, int n, char ***vals, int **lens)
+{
+	struct rows *ctx = _ctx;
+	char buf[16];
+	int i;
+
+	ctx->why = why ? strncpy(ctx->buf, why, sizeof ctx->buf -1) : 0;
+	if (why)
+		return;
+
+	ctx->batches++;
+	for (i=0; i<n; i++, ctx->n++) {
+		snprintf(buf, sizeof buf, "%d", ctx->n);
+		ctx->bad += cn != 2 || strcmp(cols[1], "id") ||
+			strcmp(vals[1][i], buf) || lens[1][i] != (int)strlen(buf) ||
+			lens[0][i] != 3;
+	}
+}
+
+TEST("Batch callback")
+{
+	struct ctx ctx = {0};
+	struct rows rows = {0};
+	boruta_stmt *sel;
+	int i;
+
+	boruta(cb, &ctx, "bc TABLE id name CREATE");
+	for (i=0; i<600; i++)
+		boruta(cb, &ctx, "bc TABLE %d id INSERT", i);
+
+	boruta_query_batch(0, rows_cb, &rows, "bc TABLE name id SELECT");
+	OK(rows.why == 0);
+	OK(rows.n == 600);
+	OK(rows.batches == 3);
+	OK(rows.bad == 0);
+
+	/* Per row callback gets same rows */
+	boruta(cb, &ctx, "bc TABLE * SELECT");
+	OK(ctx.count == 600);
+
+	memset(&rows, 0, sizeof rows);
+	sel = boruta_prepare(0, "bc TABLE ? LIMIT name id SELECT");
+	boruta_bind(sel, 1, "10");
+	boruta_exec_batch(sel, rows_cb, &rows);
+	OK(rows.n == 10);
+	OK(rows.batches == 1);
+	OK(rows.bad == 0);
+	boruta_finalize(sel);
+
+	boruta_query_batch(0, rows_cb, &rows, "bc TABLE x SELECT");
+	SAME(rows.why, "Unknown column x", -1);
+
+	boruta(cb, &ctx, "bc TABLE DROP");
+}
+
+TEST("Cursor")
+{
+	struct ctx ctx = {0};
+	struct table *t;
+	boruta_cursor *a, *b;
+	char **cols, **row;
+	int i;
+
+	boruta(cb, &ctx, "cu TABLE id name CREATE");
+	for (i=0; i<100; i++)
+		boruta(cb, &ctx, "cu TABLE %d id n%d name INSERT", i, i);
+
+	a = boruta_cursor_open(0, cb, &ctx, "cu TABLE 10 SKIP name id SELECT");
+	b = boruta_cursor_open(0, cb, &ctx, "cu TABLE 5 LIMIT id SELECT");
+	OK(a && b);
+	OK(ctx.why == 0);
+
+	/* Two result sets read in turns */
+	OK(boruta_cursor_next(a, &cols, &row) == 2);
+	SAME(cols[0], "name", -1);
+	SAME(row[0], "n10", -1);
+	SAME(row[1], "10", -1);
+	OK(boruta_cursor_next(b, &cols, &row) == 1);
+	SAME(row[0], "0", -1);
+	OK(boruta_cursor_next(a, 0, &row) == 2);
+	SAME(row[1], "11", -1);
+
+	for (i=1; boruta_cursor_next(b, 0, &row) == 1; i++);
+	OK(i == 5);
+	OK(boruta_cursor_next(b, 0, &row) == 0);
+	boruta_cursor_close(b);
+
+	/* Reading a table stops when it changes */
+	boruta(cb, &ctx, "cu TABLE 100 id INSERT");
+	OK(boruta_cursor_next(a, 0, &row) == -1);
+	SAME(ctx.why, "Table changed since cursor was opened", -1);
+	boruta_cursor_close(a);
+
+	memset(&ctx, 0, sizeof ctx);
+	a = boruta_cursor_open(0, cb, &ctx, "cu TABLE n50 name EQ id SELECT");
+	OK(boruta_cursor_next(a, 0, &row) == 1);
+	SAME(row[0], "50", -1);
+	boruta(cb, &ctx, "cu TABLE DROP cu TABLE id CREATE");
+	OK(boruta_cursor_next(a, 0, &row) == -1);
+	boruta_cursor_close(a);
+
+	/* SET of no rows leaves cells and filter values in place */
+	for (i=0; i<5000; i++)
+		boruta(cb, &ctx, "cu TABLE %d id INSERT", i);
+	t = table_get(&db0, "cu");
+	OK(t->arena.used > CHUNK);
+	memset(&ctx, 0, sizeof ctx);
+	a = boruta_cursor_open(0, cb, &ctx, "cu TABLE 7 id NEQ id SELECT");
+	OK(boruta_cursor_next(a, 0, &row) == 1);
+	t->arena.waste = t->arena.used;
+	boruta(cb, &ctx, "cu TABLE x id EQ y id SET");
+	for (i=0; boruta_cursor_next(a, 0, &row) == 1; i++);
+	OK(i == 4998);
+	OK(ctx.why == 0);
+	boruta_cursor_close(a);
+
+	/* Moving table strings to new memory changes table */
+	a = boruta_cursor_open(0, cb, &ctx, "cu TABLE 7 id NEQ id SELECT");
+	OK(boruta_cursor_next(a, 0, &row) == 1);
+	t->arena.waste = t->arena.used;
+	OK(table_gc(t) == 0);
+	OK(boruta_cursor_next(a, 0, &row) == -1);
+	SAME(ctx.why, "Table changed since cursor was opened", -1);
+	boruta_cursor_close(a);
+
+	memset(&ctx, 0, sizeof ctx);
+	OK(boruta_cursor_open(0, cb, &ctx, "cu TABLE id") == 0);
+	SAME(ctx.why, "Cursor query has no SELECT", -1);
+	OK(boruta_cursor_open(0, cb, &ctx, "cu TABLE x SELECT") == 0);
+	SAME(ctx.why, "Unknown column x", -1);
+
+	boruta(cb, &ctx, "cu TABLE DROP");
+}
+
+struct grp {
+	int n;
+	char row[8][64];
+};
+
+static void
+grp_cb(void *_ctx, char *why, int cn, char **cols, char **row)
+{
+	struct grp *ctx = _ctx;
+	int i, n;
+
+	(void)cols;
+
+	if (why || ctx->n == 8)
+		return;
+
+	for (n=0, i=0; i<cn; i++)
+		n += snprintf(ctx->row[ctx->n] + n, 64 - n, "%s%s", i ? " " : "", row[i]);
+	ctx->n++;
+}
+
+TEST("Aggregates")
+{
+	struct ctx ctx = {0};
+	struct grp grp = {0};
+
+	boruta(cb, &ctx, "ag TABLE name city age CREATE");
+	boruta(cb, &ctx, "ag TABLE Ala name Krk city 30 age INSERT");
+	boruta(cb, &ctx, "ag TABLE Ola name Waw city 25 age INSERT");
+	boruta(cb, &ctx, "ag TABLE Ela name Krk city 41 age INSERT");
+	boruta(cb, &ctx, "ag TABLE Iza name Waw city INSERT");
+	boruta(cb, &ctx, "ag TABLE Eda name Gda city x age INSERT");
+	OK(ctx.why == 0);
+
+	boruta(grp_cb, &grp, "ag TABLE COUNT age SUM age MIN age MAX age AVG GROUP");
+	OK(grp.n == 1);
+	SAME(grp.row[0], "5 96 25 x 32", -1);
+
+	memset(&grp, 0, sizeof grp);
+	boruta(grp_cb, &grp, "ag TABLE COUNT age AVG city GROUP");
+	OK(grp.n == 3);
+	SAME(grp.row[0], "Krk 2 35.5", -1);
+	SAME(grp.row[1], "Waw 2 25", -1);
+	SAME(grp.row[2], "Gda 1 ---", -1);
+
+	/* Filters, SKIP and LIMIT */
+	memset(&grp, 0, sizeof grp);
+	boruta(grp_cb, &grp, "ag TABLE Ola name NEQ 1 SKIP 1 LIMIT COUNT city GROUP");
+	OK(grp.n == 1);
+	SAME(grp.row[0], "Waw 1", -1);
+
+	memset(&grp, 0, sizeof grp);
+	boruta(grp_cb, &grp, "ag TABLE none city EQ COUNT name MAX GROUP");
+	OK(grp.n == 1);
+	SAME(grp.row[0], "0 ---", -1);
+
+	boruta(cb, &ctx, "ag TABLE city GROUP");
+	SAME(ctx.why, "Nothing to aggregate", -1);
+	boruta(cb, &ctx, "ag TABLE x SUM");
+	SAME(ctx.why, "Column x don't exist", -1);
+
+	boruta(cb, &ctx, "ag TABLE DROP");
+}
+
+TEST("Join")
+{
+	struct ctx ctx = {0};
+	struct grp grp = {0};
+	int i;
+
+	boruta(cb, &ctx, "jp TABLE id name CREATE");
+	boruta(cb, &ctx, "jp TABLE 1 id Ala name INSERT");
+	boruta(cb, &ctx, "jp TABLE 2 id Ola name INSERT");
+	boruta(cb, &ctx, "jp TABLE 3 id Ela name INSERT");
+	boruta(cb, &ctx, "jp TABLE NULL id Iza name INSERT");
+	boruta(cb, &ctx, "jo TABLE person item CREATE");
+	for (i=0; i<10; i++)
+		boruta(cb, &ctx, "jo TABLE %d person i%d item INSERT", i % 3 + 1, i);
+	boruta(cb, &ctx, "jo TABLE 9 person x item INSERT");
+	boruta(cb, &ctx, "jo TABLE y item INSERT");
+	OK(ctx.why == 0);
+
+	/* Smaller jp is hashed, rows in jo order */
+	boruta(grp_cb, &grp, "jp TABLE id jo person JOIN Ola name NEQ name item SELECT");
+	OK(grp.n == 7);
+	SAME(grp.row[0], "Ala i0", -1);
+	SAME(grp.row[1], "Ela i2", -1);
+	SAME(grp.row[2], "Ala i3", -1);
+
+	/* Joined table filter, SKIP and LIMIT */
+	memset(&grp, 0, sizeof grp);
+	boruta(grp_cb, &grp, "jp TABLE id jo person JOIN 2 jo.person EQ 1 SKIP 2 LIMIT jp.id jo.item SELECT");
+	OK(grp.n == 2);
+	SAME(grp.row[0], "2 i4", -1);
+	SAME(grp.row[1], "2 i7", -1);
+
+	/* Smaller jp joined is hashed, rows in jo order */
+	memset(&grp, 0, sizeof grp);
+	boruta(grp_cb, &grp, "jo TABLE person jp id JOIN i5 item EQ * SELECT");
+	OK(grp.n == 1);
+	SAME(grp.row[0], "3 i5 3 Ela", -1);
+
+	/* Smaller jp read in order of its sorted index */
+	memset(&grp, 0, sizeof grp);
+	boruta(cb, &ctx, "jp TABLE name SORTED");
+	boruta(grp_cb, &grp, "jp TABLE id jo person JOIN i9 jo.item NEQ 2 SKIP 5 LIMIT name ORDER jp.name jo.item SELECT");
+	OK(grp.n == 5);
+	SAME(grp.row[0], "Ala i6", -1);
+	SAME(grp.row[1], "Ela i2", -1);
+	SAME(grp.row[2], "Ela i5", -1);
+	SAME(grp.row[3], "Ela i8", -1);
+	SAME(grp.row[4], "Ola i1", -1);
+	boruta(cb, &ctx, "jp TABLE id jo person JOIN id ORDER * SELECT");
+	SAME(ctx.why, "Joined rows can't be ordered", -1);
+
+	boruta(cb, &ctx, "jp TABLE id jo none JOIN");
+	SAME(ctx.why, "Column none don't exist", -1);
+	boruta(cb, &ctx, "jp TABLE id jo person JOIN 1 jo.person GT * SELECT");
+	SAME(ctx.why, "Joined column jo.person can be filtered only with EQ and NEQ", -1);
+	boruta(cb, &ctx, "jp TABLE id jo person JOIN DEL");
+	SAME(ctx.why, "Joined tables can't be changed", -1);
+
+	boruta(cb, &ctx, "jp TABLE DROP jo TABLE DROP");
+}
+
+TEST("Order")
+{
+	struct ctx ctx = {0};
+	struct grp a = {0}, b = {0};
+	int i;
+
+	boruta(cb, &ctx, "or TABLE name city age CREATE");
+	boruta(cb, &ctx, "or TABLE Ala name Krk city 9 age INSERT");
+	boruta(cb, &ctx, "or TABLE Ola name Waw city 10 age INSERT");
+	boruta(cb, &ctx, "or TABLE Ela name Krk city 41 age INSERT");
+	boruta(cb, &ctx, "or TABLE Iza name Waw city 10 age INSERT");
+	boruta(cb, &ctx, "or TABLE Eda name Gda city x age INSERT");
+	OK(ctx.why == 0);
+
+	/* Numbers by value and before other strings */
+	boruta(grp_cb, &a, "or TABLE age ORDER name SELECT");
+	OK(a.n == 5);
+	SAME(a.row[0], "Ala", -1);
+	SAME(a.row[1], "Ola", -1);
+	SAME(a.row[2], "Iza", -1);
+	SAME(a.row[3], "Ela", -1);
+	SAME(a.row[4], "Eda", -1);
+
+	memset(&a, 0, sizeof a);
+	boruta(grp_cb, &a, "or TABLE city -age ORDER name SELECT");
+	SAME(a.row[0], "Eda", -1);
+	SAME(a.row[1], "Ela", -1);
+	SAME(a.row[2], "Ala", -1);
+	SAME(a.row[3], "Ola", -1);
+	SAME(a.row[4], "Iza", -1);
+
+	/* Top rows kept in heap */
+	memset(&a, 0, sizeof a);
+	boruta(grp_cb, &a, "or TABLE -city -name ORDER 1 SKIP 2 LIMIT name SELECT");
+	OK(a.n == 2);
+	SAME(a.row[0], "Iza", -1);
+	SAME(a.row[1], "Ela", -1);
+
+	for (i=0; i<1000; i++)
+		boruta(cb, &ctx, "or TABLE n%d name c%d city %d age INSERT",
+		       i, (i * 7919) % 13, (i * 104729) % 101);
+
+	memset(&a, 0, sizeof a);
+	boruta(grp_cb, &a, "or TABLE Waw city NEQ city -age ORDER 100 SKIP name SELECT");
+	boruta(grp_cb, &b, "or TABLE Waw city NEQ city -age ORDER 100 SKIP 8 LIMIT name SELECT");
+	OK(a.n == 8);
+	OK(b.n == 8);
+	OK(!memcmp(a.row, b.row, sizeof a.row));
+
+	memset(&ctx, 0, sizeof ctx);
+	boruta(cb, &ctx, "or TABLE Waw city NEQ city -age ORDER 100 SKIP name SELECT");
+	OK(ctx.count == 1003 - 100);
+
+	boruta(cb, &ctx, "or TABLE none ORDER");
+	SAME(ctx.why, "Column none don't exist", -1);
+	OK(boruta_cursor_open(0, cb, &ctx, "or TABLE age ORDER * SELECT") == 0);
+	SAME(ctx.why, "Cursor can read ORDER rows only of sorted index", -1);
+
+	boruta(cb, &ctx, "or TABLE DROP");
+}
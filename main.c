@@ -2,9 +2,9 @@
 #include "boruta.h"
 
 static void
-cb(void *ctx, char *why, int cn, char **cols, char **row)
+cb(void *ctx, char *why, int cn, char **cols, int n, char ***vals, int **lens)
 {
-	int i, *count;
+	int i, j, *count;
 
 	count = ctx;
 
@@ -20,12 +20,16 @@ cb(void *ctx, char *why, int cn, char **cols, char **row)
 		printf("\n");
 	}
 
-	for (i=0; i<cn; i++)
-		printf("%s\t", row[i]);
-
-	printf("\n");
+	/* Values come with lengths so rows are written without printf */
+	for (j=0; j<n; j++) {
+		for (i=0; i<cn; i++) {
+			fwrite(vals[i][j], 1, lens[i][j], stdout);
+			putchar('\t');
+		}
+		putchar('\n');
+	}
 
-	(*count)++;
+	*count += n;
 }
 
 int
@@ -34,8 +38,9 @@ main(int argc, char **argv)
 	char buf[4096];
 	int count;
 
+	count = 0;
 	if (argc > 1)
-		boruta(cb, 0, "%s LOAD", argv[1]);
+		boruta_query_batch(0, cb, &count, "%s LOAD", argv[1]);
 
 	while (1) {
 		fprintf(stderr, "boruta> ");
@@ -44,7 +49,7 @@ main(int argc, char **argv)
 			break;
 
 		count = 0;
-		boruta(cb, &count, buf);
+		boruta_query_batch(0, cb, &count, "%s", buf);
 		printf("%d\n", count);
 	}
 	printf("\n");